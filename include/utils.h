@@ -29,6 +29,7 @@ efi_status OpenProtocol(efi_handle h, efi_guid* guid, void** ifc);
 efi_status CloseProtocol(efi_handle h, efi_guid* guid);
 
 void* LoadFile(char16_t* filename, size_t* size_out);
+efi_status SaveFile(char16_t* filename, const void* data, size_t size);
 
 efi_status FindPCIMMIO(efi_boot_services* bs, uint8_t cls, uint8_t sub, uint8_t ifc, uint64_t* mmio);
 
@@ -90,3 +90,61 @@ exit1:
 exit0:
     return data;
 }
+
+efi_status SaveFile(char16_t* filename, const void* data, size_t sz) {
+    efi_loaded_image_protocol* loaded;
+    efi_status r;
+
+    r = OpenProtocol(gImg, &LoadedImageProtocol, (void**)&loaded);
+    if (r) {
+        printf("SaveFile: Cannot open LoadedImageProtocol (%s)\n", efi_strerror(r));
+        goto exit0;
+    }
+
+    efi_simple_file_system_protocol* sfs;
+    r = OpenProtocol(loaded->DeviceHandle, &SimpleFileSystemProtocol, (void**)&sfs);
+    if (r) {
+        printf("SaveFile: Cannot open SimpleFileSystemProtocol (%s)\n", efi_strerror(r));
+        goto exit1;
+    }
+
+    efi_file_protocol* root;
+    r = sfs->OpenVolume(sfs, &root);
+    if (r) {
+        printf("SaveFile: Cannot open root volume (%s)\n", efi_strerror(r));
+        goto exit2;
+    }
+
+    // start from an empty file, in case the old one was longer
+    efi_file_protocol* file;
+    r = root->Open(root, &file, filename, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (r == EFI_SUCCESS) {
+        file->Delete(file);
+    }
+    r = root->Open(root, &file, filename,
+                   EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+    if (r) {
+        printf("SaveFile: Cannot create file (%s)\n", efi_strerror(r));
+        goto exit3;
+    }
+
+    size_t len = sz;
+    r = file->Write(file, &len, (void*)data);
+    if ((r == EFI_SUCCESS) && (len != sz)) {
+        r = EFI_VOLUME_FULL;
+    }
+    if (r) {
+        printf("SaveFile: Error writing file (%s)\n", efi_strerror(r));
+        file->Delete(file);
+        goto exit3;
+    }
+    file->Close(file);
+exit3:
+    root->Close(root);
+exit2:
+    CloseProtocol(loaded->DeviceHandle, &SimpleFileSystemProtocol);
+exit1:
+    CloseProtocol(gImg, &LoadedImageProtocol);
+exit0:
+    return r;
+}
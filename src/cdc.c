@@ -0,0 +1,58 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include <cdc.h>
+
+// cut where the top CDC_BITS bits of the hash are clear
+#define CDC_MASK (((1ULL << CDC_BITS) - 1) << (64 - CDC_BITS))
+
+// a random value per byte value, which the rolling hash adds up
+static uint64_t gear[256];
+
+static void gear_init(void) {
+    uint64_t x = 0;
+
+    // splitmix64, so both ends of a transfer get the same table
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cdc_next(const uint8_t* data, size_t len) {
+    uint64_t h = 0;
+
+    if (len <= CDC_MIN) {
+        return len;
+    }
+    if (len > CDC_MAX) {
+        len = CDC_MAX;
+    }
+    if (gear[0] == 0) {
+        gear_init();
+    }
+    // each byte is shifted out of the hash 64 bytes later, so it only
+    // depends on what lies just before the cut
+    for (size_t i = CDC_MIN - 64; i < len; i++) {
+        h = (h << 1) + gear[data[i]];
+        if ((i >= CDC_MIN) && ((h & CDC_MASK) == 0)) {
+            return i + 1;
+        }
+    }
+    return len;
+}
+
+uint64_t cdc_hash(const uint8_t* data, size_t len) {
+    // 64 bit FNV-1a
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    while (len-- > 0) {
+        h = (h ^ *data++) * 0x100000001B3ULL;
+    }
+    return h;
+}
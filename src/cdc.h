@@ -0,0 +1,22 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdint.h>
+
+// Content defined chunking.  A file is cut wherever a rolling hash of the
+// bytes before the cut matches a pattern, so an edit only moves the cuts
+// next to it and the chunks elsewhere stay the same from one build of a
+// file to the next.  Chunks are CDC_MIN to CDC_MAX bytes long (except
+// for the last one) and about CDC_MIN + 2^CDC_BITS bytes on average.
+#define CDC_MIN 2048
+#define CDC_MAX 65536
+#define CDC_BITS 13
+
+// Length of the chunk at the start of the len bytes at data
+size_t cdc_next(const uint8_t* data, size_t len);
+
+// Hash of a chunk's contents
+uint64_t cdc_hash(const uint8_t* data, size_t len);
@@ -0,0 +1,69 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include <crc32c.h>
+
+// the Castagnoli polynomial, bit reversed
+#define POLY 0x82F63B78
+
+static uint32_t table[256];
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t* p, size_t len) {
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? ((c >> 1) ^ POLY) : (c >> 1);
+            }
+            table[i] = c;
+        }
+    }
+    while (len-- > 0) {
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+static int have_sse42 = -1;
+
+static int cpu_has_sse42(void) {
+    uint32_t a = 1, b, c = 0, d;
+
+    __asm__ volatile("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+    return (c >> 20) & 1;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const uint8_t* p, size_t len) {
+    uint64_t c;
+
+    while ((len > 0) && ((uintptr_t)p & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        len--;
+    }
+    for (c = crc; len >= 8; p += 8, len -= 8) {
+        c = __builtin_ia32_crc32di(c, *(const uint64_t*)p);
+    }
+    for (crc = c; len > 0; len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (have_sse42 < 0) {
+        have_sse42 = cpu_has_sse42();
+    }
+    if (have_sse42) {
+        return ~crc_hw(crc, data, len);
+    }
+#endif
+    return ~crc_sw(crc, data, len);
+}
@@ -0,0 +1,12 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdint.h>
+
+// CRC-32C (Castagnoli) of len bytes at data, continuing from crc, which
+// is 0 to start with.  Uses the SSE 4.2 CRC32 instruction where the CPU
+// has it.
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
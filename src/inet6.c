@@ -77,38 +77,123 @@ void multicast_from_ip6(mac_addr* _mac, const ip6_addr* _ip6) {
 }
 
 // ip6 stack configuration
-mac_addr ll_mac_addr;
-ip6_addr ll_ip6_addr;
-mac_addr snm_mac_addr;
-ip6_addr snm_ip6_addr;
+size_t eth_mtu = ETH_MTU;
+uint32_t udp6_bad_checksums = 0;
 
-// cache for the last source addresses we've seen
-static mac_addr rx_mac_addr;
-static ip6_addr rx_ip6_addr;
-
-void ip6_init(void* macaddr) {
+// Each interface has addresses of its own, and a cache for the last
+// source addresses seen on it
+typedef struct {
+    mac_addr ll_mac_addr;
+    ip6_addr ll_ip6_addr;
+    mac_addr snm_mac_addr;
+    ip6_addr snm_ip6_addr;
+    mac_addr rx_mac_addr;
+    ip6_addr rx_ip6_addr;
+    size_t mtu;
+} ip6_ifc;
+
+static ip6_ifc ifcs[IP6_MAX_IFC];
+unsigned ip6_ifc_count = 0;
+
+// the interface the packet being handled arrived on
+static unsigned rx_ifc = 0;
+
+// multicast groups joined on top of the solicited-node address (on the
+// first interface only, so that group data is not taken in twice)
+#define MAX_GROUPS 4
+static ip6_addr groups[MAX_GROUPS];
+static unsigned group_count = 0;
+
+int ip6_init(void* macaddr, size_t mtu) {
     char tmp[IP6TOAMAX];
     mac_addr all;
+    unsigned n = ip6_ifc_count;
+    ip6_ifc* ifc = ifcs + n;
+
+    if (n == IP6_MAX_IFC) {
+        return -1;
+    }
+    if (mtu < (ETH_HDR_LEN + IP6_MIN_MTU)) {
+        mtu = ETH_HDR_LEN + IP6_MIN_MTU;
+    } else if (mtu > ETH_MAX_MTU) {
+        mtu = ETH_MAX_MTU;
+    }
+    // (a packet may leave by any interface)
+    if ((n == 0) || (mtu < eth_mtu)) {
+        eth_mtu = mtu;
+    }
+    ifc->mtu = mtu;
 
     // save our ethernet MAC and synthesize link layer addresses
-    memcpy(&ll_mac_addr, macaddr, 6);
-    ll6addr_from_mac(&ll_ip6_addr, &ll_mac_addr);
-    snmaddr_from_mac(&snm_ip6_addr, &ll_mac_addr);
-    multicast_from_ip6(&snm_mac_addr, &snm_ip6_addr);
+    memcpy(&ifc->ll_mac_addr, macaddr, 6);
+    ll6addr_from_mac(&ifc->ll_ip6_addr, &ifc->ll_mac_addr);
+    snmaddr_from_mac(&ifc->snm_ip6_addr, &ifc->ll_mac_addr);
+    multicast_from_ip6(&ifc->snm_mac_addr, &ifc->snm_ip6_addr);
 
-    eth_add_mcast_filter(&snm_mac_addr);
+    eth_add_mcast_filter(n, &ifc->snm_mac_addr);
 
     multicast_from_ip6(&all, &ip6_ll_all_nodes);
-    eth_add_mcast_filter(&all);
+    eth_add_mcast_filter(n, &all);
+    ip6_ifc_count++;
 
     printf("macaddr: %02x:%02x:%02x:%02x:%02x:%02x\n",
-           ll_mac_addr.x[0], ll_mac_addr.x[1], ll_mac_addr.x[2],
-           ll_mac_addr.x[3], ll_mac_addr.x[4], ll_mac_addr.x[5]);
-    printf("ip6addr: %s\n", ip6toa(tmp, &ll_ip6_addr));
-    printf("snmaddr: %s\n", ip6toa(tmp, &snm_ip6_addr));
+           ifc->ll_mac_addr.x[0], ifc->ll_mac_addr.x[1], ifc->ll_mac_addr.x[2],
+           ifc->ll_mac_addr.x[3], ifc->ll_mac_addr.x[4], ifc->ll_mac_addr.x[5]);
+    printf("ip6addr: %s\n", ip6toa(tmp, &ifc->ll_ip6_addr));
+    printf("snmaddr: %s\n", ip6toa(tmp, &ifc->snm_ip6_addr));
+    printf("eth mtu: %zu\n", mtu);
+    return n;
+}
+
+void ip6_drop(void) {
+    if (ip6_ifc_count == 0) {
+        return;
+    }
+    ip6_ifc_count--;
+    eth_mtu = ETH_MTU;
+    for (unsigned n = 0; n < ip6_ifc_count; n++) {
+        if ((n == 0) || (ifcs[n].mtu < eth_mtu)) {
+            eth_mtu = ifcs[n].mtu;
+        }
+    }
+}
+
+const ip6_addr* ip6_ll_addr(unsigned n) {
+    return &ifcs[n].ll_ip6_addr;
 }
 
-static int resolve_ip6(mac_addr* _mac, const ip6_addr* _ip) {
+const mac_addr* ip6_mac_addr(unsigned n) {
+    return &ifcs[n].ll_mac_addr;
+}
+
+int ip6_join_group(const ip6_addr* group) {
+    mac_addr mac;
+
+    if (group->x[0] != 0xFF)
+        return -1;
+    for (unsigned i = 0; i < group_count; i++) {
+        if (!memcmp(groups + i, group, IP6_ADDR_LEN))
+            return 0;
+    }
+    if (group_count == MAX_GROUPS)
+        return -1;
+    multicast_from_ip6(&mac, group);
+    if (eth_add_mcast_filter(0, &mac))
+        return -1;
+    memcpy(groups + group_count, group, IP6_ADDR_LEN);
+    group_count++;
+    return 0;
+}
+
+static int is_joined(const uint8_t* addr) {
+    for (unsigned i = 0; i < group_count; i++) {
+        if (!memcmp(groups + i, addr, IP6_ADDR_LEN))
+            return 1;
+    }
+    return 0;
+}
+
+static int resolve_ip6(unsigned n, mac_addr* _mac, const ip6_addr* _ip) {
     const uint8_t* ip = _ip->x;
 
     // Multicast addresses are a simple transform
@@ -119,8 +204,8 @@ static int resolve_ip6(mac_addr* _mac, const ip6_addr* _ip) {
 
     // Trying to send to the IP that we last received a packet from?
     // Assume their mac address has not changed
-    if (memcmp(_ip, &rx_ip6_addr, sizeof(rx_ip6_addr)) == 0) {
-        memcpy(_mac, &rx_mac_addr, sizeof(rx_mac_addr));
+    if (memcmp(_ip, &ifcs[n].rx_ip6_addr, sizeof(ip6_addr)) == 0) {
+        memcpy(_mac, &ifcs[n].rx_mac_addr, sizeof(mac_addr));
         return 0;
     }
 
@@ -128,22 +213,81 @@ static int resolve_ip6(mac_addr* _mac, const ip6_addr* _ip) {
     return -1;
 }
 
+// Pick the interface to reach a unicast address by: the one the packet
+// being handled came in on if the address is known there, else any
+// other it is known on
+static unsigned route_ip6(const ip6_addr* ip) {
+    if (!memcmp(ip, &ifcs[rx_ifc].rx_ip6_addr, sizeof(ip6_addr))) {
+        return rx_ifc;
+    }
+    for (unsigned n = 0; n < ip6_ifc_count; n++) {
+        if (!memcmp(ip, &ifcs[n].rx_ip6_addr, sizeof(ip6_addr))) {
+            return n;
+        }
+    }
+    return rx_ifc;
+}
+
+// The one's complement sum can be taken over wider words and folded
+// down to 16 bits at the end (RFC 1071), so every received payload is
+// summed eight bytes at a time.
 static uint16_t checksum(const void* _data, size_t len, uint16_t _sum) {
-    uint32_t sum = _sum;
-    const uint16_t* data = _data;
-    while (len > 1) {
+    uint64_t sum = _sum;
+    const uint32_t* data = _data;
+    while (len >= 8) {
+        sum += (uint64_t)data[0] + data[1];
+        data += 2;
+        len -= 8;
+    }
+    if (len >= 4) {
         sum += *data++;
+        len -= 4;
+    }
+    const uint16_t* tail = (const uint16_t*)data;
+    if (len >= 2) {
+        sum += *tail++;
         len -= 2;
     }
     if (len) {
-        sum += (*data & 0xFF);
+        sum += (*tail & 0xFF);
+    }
+    while (sum > 0xFFFF) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
     }
+    return sum;
+}
+
+// Copy len bytes while summing them as checksum() does
+static uint16_t checksum_copy(void* _dst, const void* _src, size_t len, uint16_t _sum) {
+    uint64_t sum = _sum;
+    const uint32_t* src = _src;
+    uint32_t* dst = _dst;
+    while (len >= 8) {
+        uint32_t a = src[0];
+        uint32_t b = src[1];
+        dst[0] = a;
+        dst[1] = b;
+        sum += (uint64_t)a + b;
+        src += 2;
+        dst += 2;
+        len -= 8;
+    }
+    memcpy(dst, src, len);
+    sum += checksum(src, len, 0);
     while (sum > 0xFFFF) {
         sum = (sum & 0xFFFF) + (sum >> 16);
     }
     return sum;
 }
 
+// Add the sum of part of a packet that starts off bytes in: one at an
+// odd offset has its bytes in the other halves of the 16-bit words
+static uint16_t checksum_add(uint16_t sum, size_t off, uint16_t part) {
+    uint32_t n = sum;
+    n += (off & 1) ? (uint16_t)((part << 8) | (part >> 8)) : part;
+    return (n & 0xFFFF) + (n >> 16);
+}
+
 typedef struct {
     uint8_t eth[16];
     ip6_hdr ip6;
@@ -173,15 +317,15 @@ static unsigned ip6_checksum(ip6_hdr* ip, unsigned type, size_t length) {
     }
 }
 
-static int ip6_setup(ip6_pkt* p, const ip6_addr* daddr, size_t length, uint8_t type) {
+static int ip6_setup(unsigned n, ip6_pkt* p, const ip6_addr* daddr, size_t length, uint8_t type) {
     mac_addr dmac;
 
-    if (resolve_ip6(&dmac, daddr))
+    if (resolve_ip6(n, &dmac, daddr))
         return -1;
 
     // ethernet header
     memcpy(p->eth + 2, &dmac, ETH_ADDR_LEN);
-    memcpy(p->eth + 8, &ll_mac_addr, ETH_ADDR_LEN);
+    memcpy(p->eth + 8, &ifcs[n].ll_mac_addr, ETH_ADDR_LEN);
     p->eth[14] = (ETH_IP6 >> 8) & 0xFF;
     p->eth[15] = ETH_IP6 & 0xFF;
 
@@ -190,23 +334,22 @@ static int ip6_setup(ip6_pkt* p, const ip6_addr* daddr, size_t length, uint8_t t
     p->ip6.length = htons(length);
     p->ip6.next_header = type;
     p->ip6.hop_limit = 255;
-    memcpy(p->ip6.src, &ll_ip6_addr, sizeof(ip6_addr));
+    memcpy(p->ip6.src, &ifcs[n].ll_ip6_addr, sizeof(ip6_addr));
     memcpy(p->ip6.dst, daddr, sizeof(ip6_addr));
 
     return 0;
 }
 
-#define UDP6_MAX_PAYLOAD (ETH_MTU - ETH_HDR_LEN - IP6_HDR_LEN - UDP_HDR_LEN)
-
-int udp6_send(const void* data, size_t dlen, const ip6_addr* daddr, uint16_t dport, uint16_t sport) {
+static int udp6_send_ifc(unsigned n, const void* data, size_t dlen,
+                         const ip6_addr* daddr, uint16_t dport, uint16_t sport) {
     size_t length = dlen + UDP_HDR_LEN;
-    udp_pkt* p = eth_get_buffer(ETH_MTU + 2);
+    udp_pkt* p = eth_get_buffer(n, eth_mtu + 2);
 
     if (p == 0)
         return -1;
     if (dlen > UDP6_MAX_PAYLOAD)
         goto fail;
-    if (ip6_setup((void*)p, daddr, length, HDR_UDP))
+    if (ip6_setup(n, (void*)p, daddr, length, HDR_UDP))
         goto fail;
 
     // udp header
@@ -217,58 +360,120 @@ int udp6_send(const void* data, size_t dlen, const ip6_addr* daddr, uint16_t dpo
 
     memcpy(p->data, data, dlen);
     p->udp.checksum = ip6_checksum(&p->ip6, HDR_UDP, length);
-    return eth_send(p->eth + 2, ETH_HDR_LEN + IP6_HDR_LEN + length);
+    return eth_send(n, p->eth + 2, ETH_HDR_LEN + IP6_HDR_LEN + length);
 
 fail:
     eth_put_buffer(p);
     return -1;
 }
 
-#define ICMP6_MAX_PAYLOAD (ETH_MTU - ETH_HDR_LEN - IP6_HDR_LEN)
+int udp6_send(const void* data, size_t dlen, const ip6_addr* daddr, uint16_t dport, uint16_t sport) {
+    int r = -1;
+
+    if (daddr->x[0] != 0xFF) {
+        return udp6_send_ifc(route_ip6(daddr), data, dlen, daddr, dport, sport);
+    }
+    // multicast goes out of every interface, from each one's address
+    for (unsigned n = 0; n < ip6_ifc_count; n++) {
+        if (udp6_send_ifc(n, data, dlen, daddr, dport, sport) == 0) {
+            r = 0;
+        }
+    }
+    return r;
+}
+
+#define ICMP6_MAX_PAYLOAD (eth_mtu - ETH_HDR_LEN - IP6_HDR_LEN)
 
 static int icmp6_send(const void* data, size_t length, const ip6_addr* daddr) {
     ip6_pkt* p;
     icmp6_hdr* icmp;
 
-    p = eth_get_buffer(ETH_MTU + 2);
+    p = eth_get_buffer(rx_ifc, eth_mtu + 2);
     if (p == 0)
         return -1;
     if (length > ICMP6_MAX_PAYLOAD)
         goto fail;
-    if (ip6_setup(p, daddr, length, HDR_ICMP6))
+    if (ip6_setup(rx_ifc, p, daddr, length, HDR_ICMP6))
         goto fail;
 
     icmp = (void*)p->data;
     memcpy(icmp, data, length);
     icmp->checksum = ip6_checksum(&p->ip6, HDR_ICMP6, length);
-    return eth_send(p->eth + 2, ETH_HDR_LEN + IP6_HDR_LEN + length);
+    return eth_send(rx_ifc, p->eth + 2, ETH_HDR_LEN + IP6_HDR_LEN + length);
 
 fail:
     eth_put_buffer(p);
     return -1;
 }
 
+// The UDP packet being handled, whose payload is only summed when
+// udp6_recv() asks (all that the checksum covers, which may run past the
+// end of the UDP payload), and whether that sum has been found good (1)
+// or bad (-1)
+static const uint8_t* rx_payload;
+static size_t rx_sumlen;
+static uint16_t rx_sum;
+static int rx_checked;
+
+static int rx_verdict(uint16_t sum) {
+    rx_checked = (sum == 0xFFFF) ? 1 : -1;
+    if (rx_checked < 0) {
+        udp6_bad_checksums++;
+        return -1;
+    }
+    return 0;
+}
+
+int udp6_check(void) {
+    if (rx_checked == 0) {
+        return rx_verdict(checksum_add(rx_sum, 0, checksum(rx_payload, rx_sumlen, 0)));
+    }
+    return (rx_checked > 0) ? 0 : -1;
+}
+
+int udp6_check_copy(void* dst, const void* src, size_t len) {
+    size_t off = (const uint8_t*)src - rx_payload;
+    uint16_t sum;
+
+    if (rx_checked != 0) {
+        if (rx_checked < 0) {
+            return -1;
+        }
+        memcpy(dst, src, len);
+        return 0;
+    }
+    // (the bytes either side are only summed)
+    sum = checksum_add(rx_sum, 0, checksum(rx_payload, off, 0));
+    sum = checksum_add(sum, off, checksum_copy(dst, src, len, 0));
+    off += len;
+    return rx_verdict(checksum_add(sum, off, checksum(rx_payload + off, rx_sumlen - off, 0)));
+}
+
 void _udp6_recv(ip6_hdr* ip, void* _data, size_t len) {
     udp_hdr* udp = _data;
-    uint16_t sum, n;
+    uint16_t n;
 
     if (len < UDP_HDR_LEN)
         BAD("Bogus Header Len");
-    if (udp->checksum == 0)
+    if (udp->checksum == 0) {
+        udp6_bad_checksums++;
         BAD("Checksum Invalid");
+    }
     if (udp->checksum == 0xFFFF)
         udp->checksum = 0;
 
-    sum = checksum(&ip->length, 2, htons(HDR_UDP));
-    sum = checksum(ip->src, 32 + len, sum);
-    if (sum != 0xFFFF)
-        BAD("Checksum Incorrect");
-
     n = ntohs(udp->length);
     if (n < UDP_HDR_LEN)
         BAD("Bogus Header Len");
     if (n > len)
         BAD("Packet Too Short");
+
+    // the pseudo-header and UDP header are summed now, the payload later
+    rx_sum = checksum(&ip->length, 2, htons(HDR_UDP));
+    rx_sum = checksum(ip->src, 32 + UDP_HDR_LEN, rx_sum);
+    rx_payload = (uint8_t*)_data + UDP_HDR_LEN;
+    rx_sumlen = len - UDP_HDR_LEN;
+    rx_checked = 0;
     len = n - UDP_HDR_LEN;
 
     udp6_recv((uint8_t*)_data + UDP_HDR_LEN, len,
@@ -301,17 +506,17 @@ void icmp6_recv(ip6_hdr* ip, void* _data, size_t len) {
             BAD("Bogus NDP Message");
         if (ndp->code != 0)
             BAD("Bogus NDP Code");
-        if (memcmp(ndp->target, &ll_ip6_addr, IP6_ADDR_LEN))
+        if (memcmp(ndp->target, &ifcs[rx_ifc].ll_ip6_addr, IP6_ADDR_LEN))
             BAD("NDP Not For Me");
 
         msg.hdr.type = ICMP6_NDP_N_ADVERTISE;
         msg.hdr.code = 0;
         msg.hdr.checksum = 0;
         msg.hdr.flags = 0x60; // (S)olicited and (O)verride flags
-        memcpy(msg.hdr.target, &ll_ip6_addr, IP6_ADDR_LEN);
+        memcpy(msg.hdr.target, &ifcs[rx_ifc].ll_ip6_addr, IP6_ADDR_LEN);
         msg.opt[0] = NDP_N_TGT_LL_ADDR;
         msg.opt[1] = 1;
-        memcpy(msg.opt + 2, &ll_mac_addr, ETH_ADDR_LEN);
+        memcpy(msg.opt + 2, &ifcs[rx_ifc].ll_mac_addr, ETH_ADDR_LEN);
 
         icmp6_send(&msg, sizeof(msg), (void*)ip->src);
         return;
@@ -327,11 +532,14 @@ void icmp6_recv(ip6_hdr* ip, void* _data, size_t len) {
     BAD("ICMP6 Unhandled");
 }
 
-void eth_recv(void* _data, size_t len) {
+void eth_recv(unsigned ifc, void* _data, size_t len) {
     uint8_t* data = _data;
     ip6_hdr* ip;
     uint32_t n;
 
+    if (ifc >= ip6_ifc_count)
+        return;
+
     if (len < (ETH_HDR_LEN + IP6_HDR_LEN))
         BAD("Bogus Header Len");
     if (data[12] != (ETH_IP6 >> 8))
@@ -356,14 +564,18 @@ void eth_recv(void* _data, size_t len) {
     len = n;
 
     // require that we are the destination
-    if (memcmp(&ll_ip6_addr, ip->dst, IP6_ADDR_LEN) &&
-        memcmp(&snm_ip6_addr, ip->dst, IP6_ADDR_LEN)) {
+    if (memcmp(&ifcs[ifc].ll_ip6_addr, ip->dst, IP6_ADDR_LEN) &&
+        memcmp(&ifcs[ifc].snm_ip6_addr, ip->dst, IP6_ADDR_LEN) &&
+        memcmp(&ip6_ll_all_nodes, ip->dst, IP6_ADDR_LEN) &&
+        ((ifc != 0) || !is_joined(ip->dst))) {
         return;
     }
 
-    // stash the sender's info to simplify replies
-    memcpy(&rx_mac_addr, (uint8_t*)_data + 6, ETH_ADDR_LEN);
-    memcpy(&rx_ip6_addr, ip->src, IP6_ADDR_LEN);
+    // stash the sender's info to simplify replies, which go back out
+    // the same way
+    rx_ifc = ifc;
+    memcpy(&ifcs[ifc].rx_mac_addr, (uint8_t*)_data + 6, ETH_ADDR_LEN);
+    memcpy(&ifcs[ifc].rx_ip6_addr, ip->src, IP6_ADDR_LEN);
 
     if (ip->next_header == HDR_ICMP6) {
         icmp6_recv(ip, data, len);
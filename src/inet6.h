@@ -14,6 +14,7 @@ typedef struct ndp_n_hdr_t ndp_n_hdr;
 #define ETH_ADDR_LEN 6
 #define ETH_HDR_LEN 14
 #define ETH_MTU 1514
+#define ETH_MAX_MTU 9216
 
 #define IP6_ADDR_LEN 16
 #define IP6_HDR_LEN 40
@@ -22,6 +23,18 @@ typedef struct ndp_n_hdr_t ndp_n_hdr;
 
 #define UDP_HDR_LEN 8
 
+// largest frame (including the ethernet header) every interface handles
+extern size_t eth_mtu;
+
+// most interfaces the stack runs on at once, and how many it does
+#define IP6_MAX_IFC 4
+extern unsigned ip6_ifc_count;
+
+#define UDP6_MAX_PAYLOAD (eth_mtu - ETH_HDR_LEN - IP6_HDR_LEN - UDP_HDR_LEN)
+
+// UDP packets dropped for a bad checksum
+extern uint32_t udp6_bad_checksums;
+
 struct mac_addr_t {
     uint8_t x[ETH_ADDR_LEN];
 } __attribute__((packed));
@@ -117,14 +130,28 @@ char* ip6toa(char* _out, void* ip6addr);
 #define IP6TOAMAX 40
 
 // provided by inet6.c
-void ip6_init(void* macaddr);
-void eth_recv(void* data, size_t len);
+// Add an interface; mtu is the largest frame it can send and receive.
+// Returns the number the driver knows it by from then on, counting from
+// 0, or -1 if there are too many.
+int ip6_init(void* macaddr, size_t mtu);
+// Take back the interface added last, which the driver failed to bring up
+void ip6_drop(void);
+void eth_recv(unsigned ifc, void* data, size_t len);
+
+// the link local address of an interface
+const ip6_addr* ip6_ll_addr(unsigned ifc);
+
+// and the MAC address it was added with
+const mac_addr* ip6_mac_addr(unsigned ifc);
+
+// start accepting packets sent to a multicast group
+int ip6_join_group(const ip6_addr* group);
 
 // provided by interface driver
-void* eth_get_buffer(size_t len);
+void* eth_get_buffer(unsigned ifc, size_t len);
 void eth_put_buffer(void* ptr);
-int eth_send(void* data, size_t len);
-int eth_add_mcast_filter(const mac_addr* addr);
+int eth_send(unsigned ifc, void* data, size_t len);
+int eth_add_mcast_filter(unsigned ifc, const mac_addr* addr);
 
 // call to transmit a UDP packet
 int udp6_send(const void* data, size_t len,
@@ -136,6 +163,15 @@ void udp6_recv(void* data, size_t len,
                const ip6_addr* daddr, uint16_t dport,
                const ip6_addr* saddr, uint16_t sport);
 
+// The checksum of a packet passed to udp6_recv() is left to it, so that
+// payload it keeps is summed as it is copied out rather than read twice.
+// Nothing in the packet may be acted on until one of these returns 0,
+// and it is dropped if one returns -1. udp6_check_copy() copies len bytes
+// from src, in the payload, to dst as it checks the packet (once checked,
+// it just copies), so dst must be somewhere a bad copy does no harm.
+int udp6_check(void);
+int udp6_check_copy(void* dst, const void* src, size_t len);
+
 // NOTES
 //
 // This is an extremely minimal IPv6 stack, supporting just enough
@@ -147,10 +183,18 @@ void udp6_recv(void* data, size_t len,
 //
 // It responds to PINGs.
 //
+// It accepts multicast packets only for groups joined with
+// ip6_join_group() (in addition to its solicited-node address).
+//
 // It can only transmit to multicast addresses or to the address it
 // last received a packet from (general usecase is to reply to a UDP
 // packet from the UDP callback, which this supports)
 //
+// It can run on several interfaces, each with its own link local
+// address. Replies leave by the interface the packet came in on, and
+// multicast leaves by all of them. Groups are only joined on the
+// first.
+//
 // It does not currently do duplicate address detection, which is
 // probably the most severe bug.
 //
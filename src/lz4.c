@@ -0,0 +1,197 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+
+#include <lz4.h>
+
+// limits from the LZ4 block format: a block ends in at least 5 literals
+// and its last match starts at least 12 bytes before the end
+#define MINMATCH 4
+#define LASTLITERALS 5
+#define MFLIMIT 12
+#define MAXOFFSET 65535
+
+static uint32_t read32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t hash(uint32_t x) {
+    return (x * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t* put_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* lit, size_t litlen,
+                             uint32_t offset, size_t matchlen) {
+    uint8_t* token = op++;
+
+    *token = (litlen < 15 ? litlen : 15) << 4;
+    if (litlen >= 15) {
+        op = put_length(op, litlen - 15);
+    }
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (matchlen == 0) {
+        return op;
+    }
+    *op++ = offset;
+    *op++ = offset >> 8;
+    matchlen -= MINMATCH;
+    *token |= matchlen < 15 ? matchlen : 15;
+    if (matchlen >= 15) {
+        op = put_length(op, matchlen - 15);
+    }
+    return op;
+}
+
+// Compress [ip, end) as one block. table maps hashes of 4 byte sequences
+// to their position past base (plus one, so that 0 means none).
+static size_t compress_block(const uint8_t* base, const uint8_t* ip, const uint8_t* end,
+                             uint8_t* dst, uint32_t* table) {
+    const uint8_t* anchor = ip;
+    const uint8_t* mflimit = end - MFLIMIT;
+    const uint8_t* matchlimit = end - LASTLITERALS;
+    uint8_t* op = dst;
+    unsigned misses = 0;
+
+    if ((end - ip) >= MFLIMIT) {
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t* slot = table + hash(seq);
+            uint32_t prev = *slot;
+            const uint8_t* ref = base + prev - 1;
+            *slot = ip - base + 1;
+            if ((prev == 0) || (ref >= ip) || ((ip - ref) > MAXOFFSET) ||
+                (read32(ref) != seq)) {
+                // skip faster through data that does not compress
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            size_t len = MINMATCH;
+            while (((ip + len) < matchlimit) && (ref[len] == ip[len])) {
+                len++;
+            }
+            op = put_sequence(op, anchor, ip - anchor, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        }
+    }
+    return put_sequence(op, anchor, end - anchor, 0, 0) - dst;
+}
+
+// a block that does not shrink can grow by this much before it is stored
+#define SLACK (LZ4_CHUNK / 255 + 16)
+
+size_t lz4_bound(size_t len) {
+    size_t chunks = (len + LZ4_CHUNK - 1) / LZ4_CHUNK;
+    return len + chunks * LZ4_HDR_LEN + SLACK;
+}
+
+size_t lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, uint32_t* table) {
+    uint8_t* op = dst;
+    size_t off, n, clen;
+    uint32_t hdr;
+
+    memset(table, 0, LZ4_TABLE_SIZE * sizeof(uint32_t));
+    for (off = 0; off < len; off += n) {
+        n = len - off;
+        if (n > LZ4_CHUNK) {
+            n = LZ4_CHUNK;
+        }
+        clen = compress_block(src, src + off, src + off + n, op + LZ4_HDR_LEN, table);
+        hdr = clen;
+        if (clen >= n) {
+            // store what does not shrink
+            clen = n;
+            hdr = n | LZ4_STORED;
+            memcpy(op + LZ4_HDR_LEN, src + off, n);
+        }
+        op[0] = hdr;
+        op[1] = hdr >> 8;
+        op[2] = hdr >> 16;
+        op[3] = hdr >> 24;
+        op += LZ4_HDR_LEN + clen;
+    }
+    return op - dst;
+}
+
+static int get_length(const uint8_t** ip, const uint8_t* end, size_t* len) {
+    uint8_t b;
+
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decode(const uint8_t* src, size_t srclen, uint8_t* out, size_t outlen,
+               const uint8_t* base) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + srclen;
+    uint8_t* op = out;
+    uint8_t* oend = out + outlen;
+    size_t len;
+
+    for (;;) {
+        if (ip >= iend) {
+            return -1;
+        }
+        uint8_t token = *ip++;
+
+        len = token >> 4;
+        if ((len == 15) && get_length(&ip, iend, &len)) {
+            return -1;
+        }
+        if ((len > (size_t)(iend - ip)) || (len > (size_t)(oend - op))) {
+            return -1;
+        }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend) {
+            // the last sequence has no match
+            return op - out;
+        }
+
+        if ((iend - ip) < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > (size_t)(op - base))) {
+            return -1;
+        }
+        len = token & 15;
+        if ((len == 15) && get_length(&ip, iend, &len)) {
+            return -1;
+        }
+        len += MINMATCH;
+        if (len > (size_t)(oend - op)) {
+            return -1;
+        }
+        const uint8_t* match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            // the match overlaps what it produces
+            while (len--) {
+                *op++ = *match++;
+            }
+        }
+    }
+}
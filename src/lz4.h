@@ -0,0 +1,35 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <stdint.h>
+
+// The compressed form of a file is a series of chunks, each a 32 bit
+// little endian header followed by its payload.  The low bits of the
+// header are the payload length.  With LZ4_STORED set the payload is the
+// data as is, otherwise it is an LZ4 block.  Every chunk holds at most
+// LZ4_CHUNK bytes of data, and LZ4 matches may reach back into the data
+// of earlier chunks, so chunks must be decoded in order into one buffer.
+#define LZ4_CHUNK 65536
+#define LZ4_STORED 0x80000000
+#define LZ4_HDR_LEN 4
+
+// entries in the match table the compressor works in
+#define LZ4_HASH_BITS 16
+#define LZ4_TABLE_SIZE (1 << LZ4_HASH_BITS)
+
+// Room needed for the compressed form of len bytes
+size_t lz4_bound(size_t len);
+
+// Compress len bytes of src into dst, which must hold lz4_bound(len)
+// bytes, using table (LZ4_TABLE_SIZE entries) as scratch.  Returns the
+// length of the compressed form.
+size_t lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, uint32_t* table);
+
+// Decode an LZ4 block of srclen bytes to out, which has room for outlen
+// bytes and is preceded by earlier data from base on.  Returns the number
+// of bytes decoded, or -1 if the block is corrupt or does not fit.
+int lz4_decode(const uint8_t* src, size_t srclen, uint8_t* out, size_t outlen,
+               const uint8_t* base);
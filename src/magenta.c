@@ -193,7 +193,8 @@ static void start_kernel(kernel_t* k) {
         ;
 }
 
-static int load_kernel(efi_boot_services* bs, uint8_t* image, size_t sz, kernel_t* k) {
+int load_kernel(efi_boot_services* bs, void* _image, size_t sz, kernel_t* k) {
+    uint8_t* image = _image;
     uint32_t setup_sz;
     uint32_t image_sz;
     uint32_t setup_end;
@@ -272,8 +273,13 @@ static int load_kernel(efi_boot_services* bs, uint8_t* image, size_t sz, kernel_
 
     return 0;
 fail:
+    unload_kernel(bs, k);
+    return -1;
+}
+
+void unload_kernel(efi_boot_services* bs, kernel_t* k) {
     if (k->image) {
-        bs->FreePages((efi_physical_addr)k->image, k->pages);
+        bs->FreePages((efi_physical_addr)k->image, k->pages + 1);
     }
     if (k->cmdline) {
         bs->FreePages((efi_physical_addr)k->cmdline, 1);
@@ -281,15 +287,31 @@ fail:
     if (k->zeropage) {
         bs->FreePages((efi_physical_addr)k->zeropage, 1);
     }
-
-    return -1;
+    k->zeropage = NULL;
+    k->cmdline = NULL;
+    k->image = NULL;
+    k->pages = 0;
 }
 
 int boot_kernel(efi_handle img, efi_system_table* sys,
                 void* image, size_t sz, void* ramdisk, size_t rsz,
                 void* cmdline, size_t csz, void* cmdline2, size_t csz2) {
-    efi_boot_services* bs = sys->BootServices;
     kernel_t kernel;
+
+    printf("boot_kernel() from %p (%ld bytes)\n", image, sz);
+
+    if (load_kernel(sys->BootServices, image, sz, &kernel)) {
+        printf("Failed to load kernel image\n");
+        return -1;
+    }
+    return start_loaded_kernel(img, sys, &kernel, ramdisk, rsz,
+                               cmdline, csz, cmdline2, csz2);
+}
+
+int start_loaded_kernel(efi_handle img, efi_system_table* sys, kernel_t* k,
+                        void* ramdisk, size_t rsz,
+                        void* cmdline, size_t csz, void* cmdline2, size_t csz2) {
+    efi_boot_services* bs = sys->BootServices;
     efi_status r;
     size_t key;
     int n, i;
@@ -297,26 +319,20 @@ int boot_kernel(efi_handle img, efi_system_table* sys,
     efi_graphics_output_protocol* gop;
     bs->LocateProtocol(&GraphicsOutputProtocol, NULL, (void**)&gop);
 
-    printf("boot_kernel() from %p (%ld bytes)\n", image, sz);
     if (ramdisk && rsz) {
         printf("ramdisk at %p (%ld bytes)\n", ramdisk, rsz);
     }
 
-    if (load_kernel(sys->BootServices, image, sz, &kernel)) {
-        printf("Failed to load kernel image\n");
-        return -1;
-    }
-
-    ZP32(kernel.zeropage, ZP_EXTRA_MAGIC) = ZP_MAGIC_VALUE;
-    ZP32(kernel.zeropage, ZP_ACPI_RSD) = find_acpi_root(img, sys);
+    ZP32(k->zeropage, ZP_EXTRA_MAGIC) = ZP_MAGIC_VALUE;
+    ZP32(k->zeropage, ZP_ACPI_RSD) = find_acpi_root(img, sys);
 
-    ZP32(kernel.zeropage, ZP_FB_BASE) = (uint32_t)gop->Mode->FrameBufferBase;
-    ZP32(kernel.zeropage, ZP_FB_WIDTH) = (uint32_t)gop->Mode->Info->HorizontalResolution;
-    ZP32(kernel.zeropage, ZP_FB_HEIGHT) = (uint32_t)gop->Mode->Info->VerticalResolution;
-    ZP32(kernel.zeropage, ZP_FB_STRIDE) = (uint32_t)gop->Mode->Info->PixelsPerScanLine;
-    ZP32(kernel.zeropage, ZP_FB_FORMAT) = 5; // XRGB32
-    ZP32(kernel.zeropage, ZP_FB_REGBASE) = 0;
-    ZP32(kernel.zeropage, ZP_FB_SIZE) = 256 * 1024 * 1024;
+    ZP32(k->zeropage, ZP_FB_BASE) = (uint32_t)gop->Mode->FrameBufferBase;
+    ZP32(k->zeropage, ZP_FB_WIDTH) = (uint32_t)gop->Mode->Info->HorizontalResolution;
+    ZP32(k->zeropage, ZP_FB_HEIGHT) = (uint32_t)gop->Mode->Info->VerticalResolution;
+    ZP32(k->zeropage, ZP_FB_STRIDE) = (uint32_t)gop->Mode->Info->PixelsPerScanLine;
+    ZP32(k->zeropage, ZP_FB_FORMAT) = 5; // XRGB32
+    ZP32(k->zeropage, ZP_FB_REGBASE) = 0;
+    ZP32(k->zeropage, ZP_FB_SIZE) = 256 * 1024 * 1024;
 
     if ((csz == 0) && (csz2 != 0)) {
         cmdline = cmdline2;
@@ -328,17 +344,17 @@ int boot_kernel(efi_handle img, efi_system_table* sys,
         if (csz >= 4095) {
             csz = 4095;
         }
-        memcpy(kernel.cmdline, cmdline, csz);
+        memcpy(k->cmdline, cmdline, csz);
         if (cmdline2 && (csz2 < (4095 - csz))) {
-            memcpy(kernel.cmdline + csz, cmdline2, csz2);
+            memcpy(k->cmdline + csz, cmdline2, csz2);
             csz += csz2;
         }
-        kernel.cmdline[csz] = '\0';
+        k->cmdline[csz] = '\0';
     }
 
     if (ramdisk && rsz) {
-        ZP32(kernel.zeropage, ZP_RAMDISK_BASE) = (uint32_t) (uintptr_t) ramdisk;
-        ZP32(kernel.zeropage, ZP_RAMDISK_SIZE) = rsz;
+        ZP32(k->zeropage, ZP_RAMDISK_BASE) = (uint32_t) (uintptr_t) ramdisk;
+        ZP32(k->zeropage, ZP_RAMDISK_SIZE) = rsz;
     }
     n = process_memory_map(sys, &key, 0);
 
@@ -360,8 +376,8 @@ int boot_kernel(efi_handle img, efi_system_table* sys,
         return -1;
     }
 
-    install_memmap(&kernel, e820table, n);
-    start_kernel(&kernel);
+    install_memmap(k, e820table, n);
+    start_kernel(k);
 
     return 0;
 }
@@ -3,6 +3,7 @@
 // found in the LICENSE file.
 
 #include <efi/types.h>
+#include <efi/boot-services.h>
 #include <efi/system-table.h>
 
 typedef struct {
@@ -15,3 +16,14 @@ typedef struct {
 int boot_kernel(efi_handle img, efi_system_table* sys,
                 void* image, size_t sz, void* ramdisk, size_t rsz,
                 void* cmdline, size_t csz, void* cmdline2, size_t csz2);
+
+// boot_kernel() in two steps, so that the kernel can be put in place
+// while the ramdisk is still being fetched: load_kernel() checks image
+// and copies it to where it runs from, and start_loaded_kernel() fills
+// in the rest and jumps to it.  unload_kernel() gives back what a
+// loaded kernel holds, if it is not going to be started after all.
+int load_kernel(efi_boot_services* bs, void* image, size_t sz, kernel_t* k);
+void unload_kernel(efi_boot_services* bs, kernel_t* k);
+int start_loaded_kernel(efi_handle img, efi_system_table* sys, kernel_t* k,
+                        void* ramdisk, size_t rsz,
+                        void* cmdline, size_t csz, void* cmdline2, size_t csz2);
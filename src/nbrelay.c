@@ -0,0 +1,403 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A relay that passes Ethernet frames between the link nbserver is on
+// and a target, losing, delaying, duplicating and reordering them on the
+// way, so that netboot can be measured on a bad link on purpose. Either
+// side may be a tap interface or UDP datagrams carrying a frame each, as
+// vboot -u and qemu's "-netdev socket,udp=" send them. What happens to
+// each frame is drawn from a generator seeded on the command line, so a
+// run can be repeated.
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// large enough for a frame on a jumbo frame link
+#define MAXFRAME 16384
+
+// frames that may be held back at once
+#define MAXQUEUE 65536
+
+// Frames pass to the target (TO), and back to the host (FROM)
+#define TO 0
+#define FROM 1
+
+static char* appname;
+
+// What is done to the frames going one way, and what came of it
+typedef struct {
+    double loss;   // fraction lost
+    double burst;  // mean length of a run of losses
+    double dup;    // fraction sent twice
+    double reorder; // fraction held back by gap, so later ones pass them
+    uint64_t delay; // (in us)
+    uint64_t jitter; // the delay varies by up to this much either way
+    uint64_t gap;
+
+    uint64_t rng;
+    int losing; // in a run of losses
+
+    uint64_t frames;
+    uint64_t lost;
+    uint64_t duped;
+    uint64_t reordered;
+    uint64_t overflow; // dropped for lack of room here or on the way out
+} path;
+
+static path paths[2];
+
+// the two sides, host then target
+static int fds[2] = { -1, -1 };
+
+// A frame on its way out, and when it is due to go
+typedef struct {
+    uint64_t when;
+    uint64_t seq; // keeps frames due at once in order
+    int dir;
+    size_t len;
+    uint8_t* data;
+} frame;
+
+// a heap of the frames held back, soonest first
+static frame queue[MAXQUEUE];
+static size_t queued;
+static uint64_t seq;
+
+static volatile sig_atomic_t done;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double draw(path* p) {
+    p->rng ^= p->rng >> 12;
+    p->rng ^= p->rng << 25;
+    p->rng ^= p->rng >> 27;
+    return ((p->rng * 0x2545F4914F6CDD1DULL) >> 11) / (double)(1ULL << 53);
+}
+
+static int frame_before(const frame* a, const frame* b) {
+    return (a->when < b->when) || ((a->when == b->when) && (a->seq < b->seq));
+}
+
+static void queue_push(const frame* f) {
+    size_t i = queued++;
+
+    while (i > 0) {
+        size_t up = (i - 1) / 2;
+        if (!frame_before(f, queue + up)) {
+            break;
+        }
+        queue[i] = queue[up];
+        i = up;
+    }
+    queue[i] = *f;
+}
+
+static frame queue_pop(void) {
+    frame top = queue[0];
+    frame last = queue[--queued];
+    size_t i = 0;
+
+    for (;;) {
+        size_t n = 2 * i + 1;
+        if (n >= queued) {
+            break;
+        }
+        if (((n + 1) < queued) && frame_before(queue + n + 1, queue + n)) {
+            n++;
+        }
+        if (!frame_before(queue + n, &last)) {
+            break;
+        }
+        queue[i] = queue[n];
+        i = n;
+    }
+    queue[i] = last;
+    return top;
+}
+
+// Hold a copy of a frame back until when
+static void hold(path* p, int dir, const uint8_t* data, size_t len, uint64_t when) {
+    frame f = { .when = when, .seq = seq++, .dir = dir, .len = len };
+
+    if ((queued == MAXQUEUE) || ((f.data = malloc(len)) == NULL)) {
+        p->overflow++;
+        return;
+    }
+    memcpy(f.data, data, len);
+    queue_push(&f);
+}
+
+// Decide what becomes of a frame going dir
+static void relay(int dir, const uint8_t* data, size_t len) {
+    path* p = paths + dir;
+    uint64_t when = now() + p->delay;
+    int copies = 1;
+
+    p->frames++;
+    // losses come in runs of burst on average, making up loss of the
+    // frames overall
+    if (p->losing) {
+        p->losing = draw(p) >= (1 / p->burst);
+    } else if (p->loss < 1) {
+        p->losing = draw(p) < (p->loss / (p->burst * (1 - p->loss)));
+    } else {
+        p->losing = 1;
+    }
+    if (p->losing) {
+        p->lost++;
+        return;
+    }
+    if (draw(p) < p->dup) {
+        p->duped++;
+        copies++;
+    }
+    for (int i = 0; i < copies; i++) {
+        uint64_t t = when;
+        if (p->jitter) {
+            int64_t j = (int64_t)((2 * draw(p) - 1) * p->jitter);
+            t = ((j < 0) && ((uint64_t)-j > t)) ? 0 : (t + j);
+        }
+        if (draw(p) < p->reorder) {
+            p->reordered++;
+            t += p->gap;
+        }
+        hold(p, dir, data, len, t);
+    }
+}
+
+// Send everything that is due, and return how long until the next is
+static int64_t release(void) {
+    uint64_t t = now();
+
+    while (queued && (queue[0].when <= t)) {
+        frame f = queue_pop();
+        if (write(fds[f.dir == TO], f.data, f.len) < 0) {
+            paths[f.dir].overflow++;
+        }
+        free(f.data);
+    }
+    return queued ? (int64_t)(queue[0].when - t) : -1;
+}
+
+static void report(void) {
+    static const char* names[2] = { "to target", "from target" };
+
+    for (int dir = TO; dir <= FROM; dir++) {
+        path* p = paths + dir;
+        fprintf(stderr, "%s: %s: %llu frames, %llu lost, %llu duplicated, "
+                "%llu reordered, %llu overflowed\n", appname, names[dir],
+                (unsigned long long)p->frames, (unsigned long long)p->lost,
+                (unsigned long long)p->duped, (unsigned long long)p->reordered,
+                (unsigned long long)p->overflow);
+    }
+}
+
+static void stop(int sig) {
+    done = 1;
+}
+
+static int open_tap(const char* name) {
+    struct ifreq ifr;
+    int s;
+
+    if ((s = open("/dev/net/tun", O_RDWR)) < 0) {
+        fprintf(stderr, "%s: cannot open /dev/net/tun %d\n", appname, errno);
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(s, TUNSETIFF, &ifr) < 0) {
+        fprintf(stderr, "%s: cannot attach to tap '%s' %d\n", appname, name, errno);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// Frames go one per datagram between 127.0.0.1:local and :remote
+static int open_udp(const char* ports) {
+    struct sockaddr_in addr;
+    char* end;
+    int s, n = 4 * 1024 * 1024;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        fprintf(stderr, "%s: cannot create socket %d\n", appname, errno);
+        return -1;
+    }
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &n, sizeof(n));
+    addr.sin_port = htons(strtoul(ports, &end, 10));
+    if ((*end != ':') || (bind(s, (void*)&addr, sizeof(addr)) < 0)) {
+        fprintf(stderr, "%s: cannot bind to '%s'\n", appname, ports);
+        close(s);
+        return -1;
+    }
+    addr.sin_port = htons(strtoul(end + 1, NULL, 10));
+    if (connect(s, (void*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "%s: cannot connect to '%s'\n", appname, ports);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// A side is given as tap:<name> or udp:<port>:<peer port>
+static int open_link(const char* spec) {
+    int s = -1;
+
+    if (!strncmp(spec, "tap:", 4)) {
+        s = open_tap(spec + 4);
+    } else if (!strncmp(spec, "udp:", 4)) {
+        s = open_udp(spec + 4);
+    } else {
+        fprintf(stderr, "%s: unknown link '%s'\n", appname, spec);
+    }
+    if (s >= 0) {
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    }
+    return s;
+}
+
+void usage(void) {
+    fprintf(stderr,
+            "usage:   %s [ <option> ]* <host link> <target link>\n"
+            "\n"
+            "links:   tap:<name>             a tap interface\n"
+            "         udp:<port>:<peer port> a frame per UDP datagram on 127.0.0.1,\n"
+            "                                like vboot -u and qemu -netdev socket,udp=\n"
+            "\n"
+            "options: -d  which way the options after it apply: to (the target),\n"
+            "             from (the target) or both, the default\n"
+            "         -l  percentage of frames lost\n"
+            "         -b  mean number of frames lost in a row\n"
+            "         -D  delay (in ms)\n"
+            "         -j  jitter (in ms), the delay varies by up to this either way\n"
+            "         -u  percentage of frames duplicated\n"
+            "         -r  percentage of frames reordered\n"
+            "         -g  how long reordered frames are held back (in ms, default 1)\n"
+            "         -s  seed for what happens to each frame (default 1)\n"
+            "\n"
+            "It relays until interrupted, then prints what it did.\n",
+            appname);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    static uint8_t buf[MAXFRAME];
+    uint64_t seed = 1;
+    int from = TO, to = FROM;
+
+    appname = argv[0];
+    for (int dir = TO; dir <= FROM; dir++) {
+        paths[dir].burst = 1;
+        paths[dir].gap = 1000;
+    }
+    while ((argc > 1) && (argv[1][0] == '-')) {
+        if (argc < 3)
+            usage();
+        double val = strtod(argv[2], NULL);
+        for (int dir = from; dir <= to; dir++) {
+            path* p = paths + dir;
+            if (!strcmp(argv[1], "-d")) {
+                break;
+            } else if (!strcmp(argv[1], "-l")) {
+                p->loss = val / 100;
+            } else if (!strcmp(argv[1], "-b")) {
+                p->burst = (val < 1) ? 1 : val;
+            } else if (!strcmp(argv[1], "-D")) {
+                p->delay = val * 1000;
+            } else if (!strcmp(argv[1], "-j")) {
+                p->jitter = val * 1000;
+            } else if (!strcmp(argv[1], "-u")) {
+                p->dup = val / 100;
+            } else if (!strcmp(argv[1], "-r")) {
+                p->reorder = val / 100;
+            } else if (!strcmp(argv[1], "-g")) {
+                p->gap = val * 1000;
+            } else if (!strcmp(argv[1], "-s")) {
+                seed = strtoull(argv[2], NULL, 0);
+            } else {
+                usage();
+            }
+        }
+        if (!strcmp(argv[1], "-d")) {
+            if (!strcmp(argv[2], "to")) {
+                from = to = TO;
+            } else if (!strcmp(argv[2], "from")) {
+                from = to = FROM;
+            } else if (!strcmp(argv[2], "both")) {
+                from = TO;
+                to = FROM;
+            } else {
+                usage();
+            }
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 3) {
+        usage();
+    }
+    if (((fds[0] = open_link(argv[1])) < 0) || ((fds[1] = open_link(argv[2])) < 0)) {
+        return 1;
+    }
+    // (the generator must not start at 0)
+    paths[TO].rng = (seed * 2 + 1) * 0x9E3779B97F4A7C15ULL;
+    paths[FROM].rng = (seed * 2 + 2) * 0x9E3779B97F4A7C15ULL;
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    while (!done) {
+        struct pollfd p[2] = {
+            { .fd = fds[0], .events = POLLIN },
+            { .fd = fds[1], .events = POLLIN },
+        };
+        int64_t wait = release();
+        struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+        ssize_t r;
+
+        if (ppoll(p, 2, (wait < 0) ? NULL : &ts, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: poll error %d\n", appname, errno);
+            break;
+        }
+        // frames from the host go to the target, and the other way
+        for (int side = 0; side < 2; side++) {
+            while ((r = read(fds[side], buf, sizeof(buf))) > 0) {
+                relay(side ? FROM : TO, buf, r);
+            }
+        }
+    }
+    report();
+    return 0;
+}
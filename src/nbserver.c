@@ -2,193 +2,2943 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+// for sendmmsg() and recvmmsg()
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <net/if.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <errno.h>
 #include <stdint.h>
 
+#include "cdc.h"
+#include "crc32c.h"
+#include "lz4.h"
 #include "netboot.h"
 
+// large enough for a block on a jumbo frame link
+#define MAXPACKET 16384
+
+// how long to wait for an ack (in us) before resending, until there is
+// a round trip time to go by, and the bounds on what it may work out to.
+// Each timeout in a row doubles the wait, and after RETRIES of them the
+// target is given up on.
+#define RTO (250 * 1000)
+#define RTO_MIN (5 * 1000)
+#define RTO_MAX (2000 * 1000)
+#define RETRIES 10
+
+// how long a repair round waits for the rest of its acks once one is in
+#define QUIET (10 * 1000)
+
+// A block is presumed lost once this many packets sent after it arrived
+// (over the same port, as a target with several reorders across them),
+// and it has been out for longer than a round trip and the time a block
+// may be overtaken for (see xfer.reorder)
+#define DUPTHRESH 3
+
+// how many blocks are sent, and acks read, per system call
+#define TXBATCH 64
+// parity blocks (see NB_PARITY) a batch can hold
+#define TXPARITY 16
+#define RXBATCH 64
+
 static uint32_t cookie = 1;
 static char* appname;
 
-static int io(int s, nbmsg* msg, size_t len, nbmsg* ack) {
-    int retries = 5;
-    int r;
+// print a summary of each session as a line of JSON on stdout
+static int json = 0;
+
+// every session sends from, and reads its acks on, this one socket
+static int xs = -1;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void xsend_error(void) {
+    // a dropped send is recovered like any other lost packet
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != ENOBUFS)) {
+        fprintf(stderr, "\n%s: socket write error %d\n", appname, errno);
+    }
+}
+
+// Blocks waiting to go out. Each is gathered from its header and the
+// image it is part of, so its data is never copied before the kernel
+// does. The images must stay put until txq_flush(). Parity blocks are
+// worked out into a buffer of their own.
+static struct {
+    struct mmsghdr msg[TXBATCH];
+    struct iovec iov[TXBATCH][2];
+    struct sockaddr_in6 to[TXBATCH];
+    uint8_t head[TXBATCH][sizeof(nbmsg) + sizeof(uint32_t)];
+    unsigned count;
+    uint8_t parity[TXPARITY][MAXPACKET];
+    unsigned parities;
+} txq;
+
+static void txq_flush(void) {
+    unsigned n = 0;
+    int r;
+
+    while (n < txq.count) {
+        if ((r = sendmmsg(xs, txq.msg + n, txq.count - n, 0)) < 0) {
+            // skip the one that failed
+            xsend_error();
+            r = 1;
+        }
+        n += r;
+    }
+    txq.count = 0;
+    txq.parities = 0;
+}
+
+// Queue the header in the next free slot, which is hlen long, and len
+// bytes of data after it
+static void txq_add(const struct sockaddr_in6* to, size_t hlen, const void* data, size_t len) {
+    unsigned i = txq.count++;
+
+    txq.to[i] = *to;
+    txq.iov[i][0].iov_base = txq.head[i];
+    txq.iov[i][0].iov_len = hlen;
+    txq.iov[i][1].iov_base = (void*)data;
+    txq.iov[i][1].iov_len = len;
+    memset(&txq.msg[i], 0, sizeof(txq.msg[i]));
+    txq.msg[i].msg_hdr.msg_name = txq.to + i;
+    txq.msg[i].msg_hdr.msg_namelen = sizeof(txq.to[i]);
+    txq.msg[i].msg_hdr.msg_iov = txq.iov[i];
+    txq.msg[i].msg_hdr.msg_iovlen = 2;
+}
+
+// Send a message straight away, after any blocks queued before it
+static void xsend(const struct sockaddr_in6* to, const void* data, size_t len) {
+    txq_flush();
+    if (sendto(xs, data, len, 0, (void*)to, sizeof(*to)) < 0) {
+        xsend_error();
+    }
+}
+
+// A file mapped into memory once and shared by every session sending it.
+// It is mapped again when the file changes; a copy that sessions are still
+// sending stays around until the last of them is done with it. That only
+// holds for files that are replaced (say, renamed over) rather than
+// rewritten in place, as the copy is the file's own pages.
+typedef struct image image;
+struct image {
+    image* next;
+    char* path;
+    uint8_t* data;
+    size_t size;
+    size_t mapped; // length of the mapping data is in, if it is one
+    struct stat st;
+    int refs;
+
+    // its compressed form, made the first time a session asks for it
+    uint8_t* lz4;
+    size_t lz4size;
+    int packed;
+
+    // its chunks, listed the first time a bootloader takes a delta of it
+    nbchunk* chunks;
+    size_t nchunks;
+
+    // its CRC-32C, once worked out
+    uint32_t crc;
+    int summed;
+};
+
+static image* images;
+
+static void image_free(image* img) {
+    free(img->path);
+    if (img->mapped) {
+        munmap(img->data, img->mapped);
+    } else {
+        free(img->data);
+    }
+    free(img->lz4);
+    free(img->chunks);
+    free(img);
+}
+
+// Compress an image once for every session that sends it. Returns
+// whether that makes it any smaller.
+static int image_lz4(image* img) {
+    uint32_t* table;
+
+    if (!img->packed) {
+        img->packed = 1;
+        if ((table = malloc(LZ4_TABLE_SIZE * sizeof(uint32_t))) == NULL) {
+            return 0;
+        }
+        if ((img->lz4 = malloc(lz4_bound(img->size))) != NULL) {
+            img->lz4size = lz4_compress(img->data, img->size, img->lz4, table);
+        }
+        free(table);
+    }
+    return img->lz4 && (img->lz4size < img->size);
+}
+
+static uint32_t image_crc(image* img) {
+    if (!img->summed) {
+        img->crc = crc32c(0, img->data, img->size);
+        img->summed = 1;
+    }
+    return img->crc;
+}
+
+// List an image's chunks once for every session that sends it as a delta
+static int image_chunks(image* img) {
+    size_t off, n;
+
+    if (img->chunks) {
+        return 0;
+    }
+    for (off = 0; off < img->size; off += n) {
+        n = cdc_next(img->data + off, img->size - off);
+        img->nchunks++;
+    }
+    if ((img->chunks = calloc(img->nchunks + 1, sizeof(nbchunk))) == NULL) {
+        img->nchunks = 0;
+        return -1;
+    }
+    nbchunk* c = img->chunks;
+    for (off = 0; off < img->size; off += c->len, c++) {
+        c->len = cdc_next(img->data + off, img->size - off);
+        c->offset = off;
+        c->hash = cdc_hash(img->data + off, c->len);
+    }
+    return 0;
+}
+
+// Map the file open as fd into a new image, which is not in the cache yet
+static image* image_map(const char* path, int fd, const struct stat* st) {
+    image* img;
+    void* map;
+
+    if ((img = calloc(1, sizeof(image))) == NULL) {
+        return NULL;
+    }
+    img->path = strdup(path);
+    if (img->path == NULL) {
+        goto fail;
+    }
+    // (its pages are read in up front, rather than as each is sent)
+    if (st->st_size == 0) {
+        img->data = malloc(1);
+    } else if ((map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                           fd, 0)) != MAP_FAILED) {
+        img->data = map;
+        img->mapped = st->st_size;
+    } else {
+        fprintf(stderr, "%s: error: mapping '%s'\n", appname, path);
+        goto fail;
+    }
+    if (img->data == NULL) {
+        goto fail;
+    }
+    img->size = st->st_size;
+    img->st = *st;
+    return img;
+
+fail:
+    image_free(img);
+    return NULL;
+}
+
+// Put an image in the cache, in place of any older copy of its file
+static void image_add(image* img) {
+    image** p;
+    image* old;
+
+    for (p = &images; (old = *p) != NULL; p = &old->next) {
+        if (!strcmp(old->path, img->path)) {
+            *p = old->next;
+            if (old->refs == 0) {
+                image_free(old);
+            }
+            break;
+        }
+    }
+    img->next = images;
+    images = img;
+}
+
+static image* image_get(const char* path) {
+    struct stat st;
+    image* img;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        goto fail;
+    }
+    for (img = images; img != NULL; img = img->next) {
+        if (strcmp(img->path, path)) {
+            continue;
+        }
+        if ((img->st.st_dev == st.st_dev) && (img->st.st_ino == st.st_ino) &&
+            (img->st.st_size == st.st_size) &&
+            (img->st.st_mtim.tv_sec == st.st_mtim.tv_sec) &&
+            (img->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec)) {
+            img->refs++;
+            close(fd);
+            return img;
+        }
+        break;
+    }
+    if ((img = image_map(path, fd, &st)) == NULL) {
+        goto fail;
+    }
+    close(fd);
+    img->refs = 1;
+    image_add(img);
+    return img;
+
+fail:
+    close(fd);
+    return NULL;
+}
+
+static void image_put(image* img) {
+    if (--img->refs > 0) {
+        return;
+    }
+    // the current copy of a file is kept for the next session
+    for (image* i = images; i != NULL; i = i->next) {
+        if (i == img) {
+            return;
+        }
+    }
+    image_free(img);
+}
+
+// Transmit state of a block in flight, indexed by block number modulo
+// the window.
+typedef struct {
+    uint32_t seq; // transmit sequence number of the latest send
+    uint32_t parity; // that of the parity of its group, once sent
+    int sacked;
+    uint64_t when; // when it was sent, or 0 once resent
+    uint64_t last; // when it was last sent
+} txblock;
+
+// most files a session can send
+#define MAXFILES 8
+
+// a file every target is sent, and the name the bootloader knows it by
+typedef struct {
+    const char* name;
+    const char* path;
+    image* img; // the cmdline, which is sent from memory
+
+    // in watch mode, the watch on its directory, and its name there
+    int wd;
+    const char* file;
+} artifact;
+
+// every file any target may be sent
+#define MAXARTIFACTS 256
+static artifact artifacts[MAXARTIFACTS];
+static int artifact_count = 0;
+
+// The files a target is sent. Those given on the command line are the
+// default set; a registry (see -r) adds a set for each kind of machine,
+// which those that advertise value for key are sent instead.
+typedef struct {
+    char* key;
+    char* value;
+    int first; // its files are artifacts[first] on
+    int count;
+    int unnamed; // files given without a name so far
+} imageset;
+
+#define MAXSETS 64
+static imageset sets[MAXSETS];
+static int set_count = 1;
+
+// What a session, or one of its files, waits for: an ack carrying cookie,
+// before deadline (0 when not waiting), to a message sent at when (0 if
+// it has been resent, so the ack can't be timed). A control message is
+// kept here to be resent.
+typedef struct {
+    uint32_t cookie;
+    uint64_t deadline;
+    uint64_t when;
+    int retries;
+    uint8_t ctl[sizeof(nbmsg) + 256];
+    size_t ctllen;
+} waiter;
+
+enum {
+    S_JOIN,  // NB_JOIN_GROUP sent
+    S_FILES, // sending files
+    S_STATS, // NB_STATS sent
+    S_BOOT,  // NB_BOOT sent
+    S_DONE,
+    S_FAILED,
+};
+
+enum {
+    X_IDLE,      // not started yet
+    X_QUERY,     // NB_QUERY sent
+    X_SEND_FILE, // NB_SEND_FILE sent
+    X_INDEX,     // sending the chunk list of a delta
+    X_READY,     // in a group, waiting for its multicast push to finish
+    X_DATA,      // sending the file
+    X_REPAIR,    // filling in what a multicast push missed
+    X_DONE,
+};
+
+typedef struct group group;
+typedef struct session session;
+
+// One file of a session
+typedef struct {
+    session* s;
+    image* img;
+    const char* name;
+    int state;
+    uint32_t window;
+    waiter w;
+
+    // whether offsets are sent in 64 bits (see NB_FILE_WIDE), and where
+    // it resumes, if the bootloader holds the start of it
+    int wide;
+    uint64_t from;
+
+    // what goes on the wire: the image, its compressed form, or the
+    // chunks of it a delta is missing
+    const uint8_t* data;
+    size_t size;
+
+    // for a delta: which chunks the bootloader has, which of the nmsgs
+    // NB_CHUNKS are acked (ibase is the first that is not, isent the
+    // first never sent), and for each block of the stream of missing
+    // chunks, where it starts in the stream (boff) and in the file (bpos)
+    uint8_t* have;
+    uint8_t* acked;
+    uint32_t nmsgs;
+    uint32_t ibase;
+    uint32_t isent;
+    uint32_t* boff;
+    uint32_t* bpos;
+
+    // blocks to a parity group (see NB_FILE_FEC), or 0 for none
+    uint32_t fec;
+
+    // whether it is sent by unicast although the session is in a group
+    // (see xfer_solo())
+    int solo;
+
+    // data is sent to dst (the group, for the leader of a multicast
+    // push); base is the first block not acked, sent the first never sent
+    const struct sockaddr_in6* dst;
+    uint32_t nblocks;
+    uint32_t base;
+    uint32_t sent;
+    uint32_t seq;
+    // latest sequence number known to have arrived, on each port (data
+    // to a target with several goes out of order across them), going by
+    // blocks that were never resent
+    uint32_t delivered[NB_MAX_NICS];
+    txblock* tx;
+
+    // how long past a round trip a block may arrive after others sent
+    // later, as learned from resends that turned out needless (at least
+    // a quarter of a round trip, at most one), and whether the deadline
+    // is when some that were overtaken may be presumed lost, rather than
+    // a timeout
+    uint64_t reorder;
+    int recheck;
+
+    // newest ack of the current repair round, and acks still expected
+    uint8_t snap[sizeof(nbmsg) + sizeof(uint32_t) + NB_MAX_SACK * sizeof(nbrange64)];
+    size_t snaplen;
+    uint32_t pending;
+
+    // when it started and finished, blocks sent and resent, parity
+    // blocks sent, round trip times measured (in us), and timeouts taken
+    uint64_t begun;
+    uint64_t ended;
+    uint32_t blocks;
+    uint32_t resent;
+    uint32_t parities;
+    uint32_t rtts;
+    uint64_t rtt_min;
+    uint64_t rtt_max;
+    uint64_t rtt_sum;
+    uint32_t timeouts;
+
+    // what the bootloader counted (see NB_STATS)
+    uint32_t rx_packets;
+    uint64_t rx_bytes;
+    uint32_t rx_dups;
+    uint32_t rx_dropped;
+    uint32_t rx_recovered;
+} xfer;
+
+// Everything sent to one bootloader, from its beacon to NB_BOOT. Acks are
+// matched to their session by the address they come from, then to the
+// session itself or one of its files by the cookie they carry.
+struct session {
+    session* next;
+    struct sockaddr_in6 addr;
+    struct sockaddr_in6 nics[NB_MAX_NICS]; // its ports, addr first
+    int nnics;
+    char name[INET6_ADDRSTRLEN];
+    group* grp;
+    int state;
+    waiter w;
+    uint32_t window;
+    uint32_t files; // how many files the bootloader receives at once
+    size_t blksz;
+    int lz4; // files may be sent compressed
+    int crc; // files may be sent with their CRC
+    int stats; // the bootloader reports what it counted
+    int resume; // files may be resumed part way in
+    int sized; // the bootloader makes room for files as large as we say
+    int wide; // files may be 4GB or more
+    int fec; // lost blocks may be rebuilt from parity
+    uint64_t started;
+
+    // how many blocks in a million it loses, as far as is known (-1 if
+    // nothing is)
+    int loss;
+
+    // what the bootloader counted on its link, once reported
+    int rx_stats;
+    uint32_t rx_checksum;
+    uint32_t rx_nobuf;
+
+    // smoothed round trip time, its mean deviation, and the timeout they
+    // give (in us)
+    uint64_t srtt;
+    uint64_t rttvar;
+    uint64_t rto;
+    xfer xfers[MAXFILES];
+    int count;
+    int opened; // files started so far
+};
+
+// Targets that share a multicast push of each file. The leader's acks
+// pace the data sent to the group; the other members are repaired
+// afterwards.
+struct group {
+    struct sockaddr_in6 addr;
+    size_t blksz; // smallest block size of any member
+    int lz4;      // every member takes compressed files
+    int fec;      // every member rebuilds lost blocks from parity
+    int members;  // sessions still referring to the group
+    struct {
+        xfer* leader;
+        uint32_t cookie;
+        uint32_t fec; // blocks to a parity group, as the leader chose
+        int joining; // members not yet ready for its data
+        int started;
+    } file[MAXFILES];
+};
+
+// the group multicast pushes go to (transient, link-local scope)
+#define NB_GROUP "ff12::6e62"
+
+static session* sessions;
+
+static void start_data(xfer* x);
+static void session_fail(session* s, const char* why);
+
+static void tick(size_t n) {
+    static size_t count;
+
+    count += n;
+    while (count >= (32 * 1024)) {
+        count -= 32 * 1024;
+        fprintf(stderr, "#");
+    }
+}
+
+// Fold the round trip time of an ack into the session's estimate, the way
+// TCP does (RFC 6298), and into the statistics of the file it was for
+static void rtt_sample(session* s, xfer* x, uint64_t rtt) {
+    if (s->srtt == 0) {
+        s->srtt = rtt;
+        s->rttvar = rtt / 2;
+    } else {
+        uint64_t err = (rtt > s->srtt) ? (rtt - s->srtt) : (s->srtt - rtt);
+        s->rttvar = (3 * s->rttvar + err) / 4;
+        s->srtt = (7 * s->srtt + rtt) / 8;
+    }
+    if (s->srtt == 0) {
+        s->srtt = 1;
+    }
+    s->rto = s->srtt + 4 * s->rttvar;
+    if (s->rto < RTO_MIN) {
+        s->rto = RTO_MIN;
+    } else if (s->rto > RTO_MAX) {
+        s->rto = RTO_MAX;
+    }
+    if (x) {
+        if ((x->rtts == 0) || (rtt < x->rtt_min)) {
+            x->rtt_min = rtt;
+        }
+        if (rtt > x->rtt_max) {
+            x->rtt_max = rtt;
+        }
+        x->rtt_sum += rtt;
+        x->rtts++;
+    }
+}
+
+// When to give up waiting on w, backing off for each timeout in a row
+static uint64_t expiry(session* s, const waiter* w) {
+    uint64_t rto = s->rto << (RETRIES - w->retries);
+
+    return now() + ((rto < RTO_MAX) ? rto : RTO_MAX);
+}
+
+// Find the value of key in the "key\0value\0" list a message carries
+static const char* adv_get(nbmsg* msg, size_t len, const char* key) {
+    const char* p = (const char*)msg->data;
+    const char* end = (const char*)msg + len;
+    size_t n;
+
+    while (p < end) {
+        n = strnlen(p, end - p);
+        if ((p + n) >= end) {
+            break;
+        }
+        const char* val = p + n + 1;
+        size_t vn = strnlen(val, end - val);
+        if ((val + vn) >= end) {
+            break;
+        }
+        if (!strcmp(p, key)) {
+            return val;
+        }
+        p = val + vn + 1;
+    }
+    return NULL;
+}
+
+// The set of files for a target, by what it advertised: the first one
+// whose key it gave the value of, or the default
+static const imageset* set_find(nbmsg* msg, size_t len) {
+    for (int i = 1; i < set_count; i++) {
+        const char* val = adv_get(msg, len, sets[i].key);
+        if (val && !strcasecmp(val, sets[i].value)) {
+            return sets + i;
+        }
+    }
+    return sets;
+}
+
+// Take in the "key\0value\0" list an NB_STATS ack carries
+static void stats_recv(session* s, nbmsg* ack, size_t len) {
+    const char* p = (const char*)ack->data;
+    const char* end = (const char*)ack + len;
+    xfer* x = NULL;
+    size_t n;
+
+    s->rx_stats = 1;
+    while (p < end) {
+        n = strnlen(p, end - p);
+        if ((p + n) >= end) {
+            break;
+        }
+        const char* val = p + n + 1;
+        size_t vn = strnlen(val, end - val);
+        if ((val + vn) >= end) {
+            break;
+        }
+        unsigned long long v = strtoull(val, NULL, 10);
+        if (!strcmp(p, "file")) {
+            // the bootloader may have cut the name short
+            x = NULL;
+            for (int i = 0; (i < s->count) && (vn > 0); i++) {
+                if (!strncmp(s->xfers[i].name, val, vn)) {
+                    x = s->xfers + i;
+                    break;
+                }
+            }
+        } else if (!strcmp(p, "checksum")) {
+            s->rx_checksum = v;
+        } else if (!strcmp(p, "nobuf")) {
+            s->rx_nobuf = v;
+        } else if (x && !strcmp(p, "packets")) {
+            x->rx_packets = v;
+        } else if (x && !strcmp(p, "bytes")) {
+            x->rx_bytes = v;
+        } else if (x && !strcmp(p, "dups")) {
+            x->rx_dups = v;
+        } else if (x && !strcmp(p, "dropped")) {
+            x->rx_dropped = v;
+        } else if (x && !strcmp(p, "recovered")) {
+            x->rx_recovered = v;
+        }
+        p = val + vn + 1;
+    }
+}
+
+static void json_str(const char* str) {
+    putchar('"');
+    for (; *str; str++) {
+        if ((*str == '"') || (*str == '\\')) {
+            printf("\\%c", *str);
+        } else if ((unsigned char)*str < ' ') {
+            printf("\\u%04x", *str);
+        } else {
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
+
+// Report how each file of a session went, and what the bootloader
+// counted if it said
+static void session_report(session* s) {
+    uint64_t t = now();
+
+    for (int i = 0; i < s->opened; i++) {
+        xfer* x = s->xfers + i;
+        fprintf(stderr, "%s: [%s] '%s' %u blocks sent, %u resent, %u timeouts", appname,
+                s->name, x->name, x->blocks, x->resent, x->timeouts);
+        if (x->parities) {
+            fprintf(stderr, ", %u parity (1 per %u)", x->parities, x->fec);
+        }
+        if (x->rtts) {
+            fprintf(stderr, ", rtt min/avg/max %.2f/%.2f/%.2f ms", x->rtt_min / 1000.0,
+                    x->rtt_sum / 1000.0 / x->rtts, x->rtt_max / 1000.0);
+        }
+        if (s->rx_stats) {
+            fprintf(stderr, ", target got %u (%u dups, %u dropped, %u recovered)",
+                    x->rx_packets, x->rx_dups, x->rx_dropped, x->rx_recovered);
+        }
+        fprintf(stderr, "\n");
+    }
+    if (s->rx_stats && (s->rx_checksum || s->rx_nobuf)) {
+        fprintf(stderr, "%s: [%s] target dropped %u packets with bad checksums, "
+                "ran out of buffers %u times\n", appname, s->name, s->rx_checksum, s->rx_nobuf);
+    }
+    if (!json) {
+        return;
+    }
+    printf("{\"target\":\"%s\",\"booted\":%s,\"ms\":%llu,\"srtt_us\":%llu,\"rto_us\":%llu",
+           s->name, (s->state == S_DONE) ? "true" : "false",
+           (unsigned long long)(t - s->started) / 1000, (unsigned long long)s->srtt,
+           (unsigned long long)s->rto);
+    if (s->rx_stats) {
+        printf(",\"checksum\":%u,\"nobuf\":%u", s->rx_checksum, s->rx_nobuf);
+    }
+    printf(",\"files\":[");
+    for (int i = 0; i < s->opened; i++) {
+        xfer* x = s->xfers + i;
+        uint64_t ended = x->ended ? x->ended : t;
+        printf("%s{\"name\":", i ? "," : "");
+        json_str(x->name);
+        printf(",\"size\":%zu,\"wire\":%zu,\"ms\":%llu,\"blocks\":%u,\"resent\":%u,"
+               "\"timeouts\":%u", x->img->size, x->size,
+               (unsigned long long)(ended - x->begun) / 1000, x->blocks, x->resent, x->timeouts);
+        if (x->parities) {
+            printf(",\"fec\":%u,\"parities\":%u", x->fec, x->parities);
+        }
+        if (x->rtts) {
+            printf(",\"rtt_us\":{\"n\":%u,\"min\":%llu,\"avg\":%llu,\"max\":%llu}", x->rtts,
+                   (unsigned long long)x->rtt_min, (unsigned long long)(x->rtt_sum / x->rtts),
+                   (unsigned long long)x->rtt_max);
+        }
+        if (s->rx_stats) {
+            printf(",\"rx\":{\"packets\":%u,\"bytes\":%llu,\"dups\":%u,\"dropped\":%u,"
+                   "\"recovered\":%u}", x->rx_packets, (unsigned long long)x->rx_bytes,
+                   x->rx_dups, x->rx_dropped, x->rx_recovered);
+        }
+        printf("}");
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
+
+// How much of the file goes in a block, which for a wide file leaves
+// room for the high half of its offset
+static size_t block_len(xfer* x) {
+    return x->wide ? (x->s->blksz - sizeof(uint32_t)) : x->s->blksz;
+}
+
+// Where block n starts on the wire. Blocks are block_len() long, except
+// for the last one and, in a delta, those that end a chunk.
+static uint64_t block_off(xfer* x, uint32_t n) {
+    if (x->boff) {
+        return x->boff[n];
+    }
+    return ((n * block_len(x)) < x->size) ? (n * block_len(x)) : x->size;
+}
+
+// How many blocks end at or before off, which is also the block that
+// holds off
+static uint32_t block_at(xfer* x, uint64_t off) {
+    uint32_t lo = 0, hi = x->nblocks;
+
+    if (x->boff == NULL) {
+        return (off < x->size) ? (off / block_len(x)) : x->nblocks;
+    }
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo + 1) / 2;
+        if (x->boff[mid] <= off) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// The first block that starts at or after off
+static uint32_t block_from(xfer* x, uint64_t off) {
+    uint32_t n = block_at(x, off);
+    return (block_off(x, n) < off) ? (n + 1) : n;
+}
+
+// The port of the target block n goes to when sent to to: windowed data
+// sent to the target itself is spread over all it has
+static int block_port(xfer* x, const struct sockaddr_in6* to, uint32_t n) {
+    if ((to != &x->s->addr) || !x->window || (x->s->nnics < 2)) {
+        return 0;
+    }
+    return (n / NB_STRIPE) % x->s->nnics;
+}
+
+// Queue block n to go out with the next batch
+static void send_block(xfer* x, const struct sockaddr_in6* to, uint32_t n) {
+    uint64_t off = block_off(x, n);
+    size_t len = block_off(x, n + 1) - off;
+    const uint8_t* data = x->data + off;
+    uint32_t hi = off >> 32;
+    nbmsg* msg;
+
+    if (to == &x->s->addr) {
+        to = x->s->nics + block_port(x, to, n);
+    }
+    if (txq.count == TXBATCH) {
+        txq_flush();
+    }
+    msg = (void*)txq.head[txq.count];
+    msg->magic = NB_MAGIC;
+    msg->cookie = x->w.cookie;
+    msg->cmd = NB_DATA;
+    msg->arg = off;
+    if (x->wide) {
+        // a wide block leads with the high half of its offset
+        memcpy(msg->data, &hi, sizeof(uint32_t));
+    } else if (x->bpos) {
+        // a delta block leads with where it goes in the file
+        memcpy(msg->data, x->bpos + n, sizeof(uint32_t));
+        data = x->data + x->bpos[n];
+    }
+    x->blocks++;
+    txq_add(to, sizeof(nbmsg) + ((x->wide || x->bpos) ? sizeof(uint32_t) : 0), data, len);
+}
+
+// The last block of the parity group block n is in
+static uint32_t group_end(xfer* x, uint32_t n) {
+    uint32_t end = (n / x->fec + 1) * x->fec;
+    return ((end < x->nblocks) ? end : x->nblocks) - 1;
+}
+
+// Queue the parity of the group of blocks that ends with block n: all of
+// them XORed together, each padded out to a full block (see NB_PARITY).
+// It goes to the port the last of them did.
+static void send_parity(xfer* x, const struct sockaddr_in6* to, uint32_t n) {
+    uint32_t first = n - (n % x->fec);
+    uint64_t off = block_off(x, first);
+    size_t blksz = block_len(x);
+    uint32_t hi = off >> 32;
+    uint64_t a, b;
+    uint8_t* p;
+    nbmsg* msg;
+
+    if (to == &x->s->addr) {
+        to = x->s->nics + block_port(x, to, n);
+    }
+    if ((txq.count == TXBATCH) || (txq.parities == TXPARITY)) {
+        txq_flush();
+    }
+    p = txq.parity[txq.parities++];
+    memset(p, 0, blksz);
+    for (uint32_t k = first; k <= n; k++) {
+        const uint8_t* data = x->data + block_off(x, k);
+        size_t len = block_off(x, k + 1) - block_off(x, k);
+        size_t i = 0;
+        for (; (i + sizeof(a)) <= len; i += sizeof(a)) {
+            memcpy(&a, p + i, sizeof(a));
+            memcpy(&b, data + i, sizeof(b));
+            a ^= b;
+            memcpy(p + i, &a, sizeof(a));
+        }
+        for (; i < len; i++) {
+            p[i] ^= data[i];
+        }
+    }
+    msg = (void*)txq.head[txq.count];
+    msg->magic = NB_MAGIC;
+    msg->cookie = x->w.cookie;
+    msg->cmd = NB_PARITY;
+    msg->arg = off;
+    if (x->wide) {
+        memcpy(msg->data, &hi, sizeof(uint32_t));
+    }
+    x->parities++;
+    txq_add(to, sizeof(nbmsg) + (x->wide ? sizeof(uint32_t) : 0), p, blksz);
+}
+
+// Send a control message, which is resent until acked
+static void send_ctl(session* s, waiter* w, uint32_t cmd, uint32_t arg,
+                     const void* data, size_t len, uint32_t xcookie) {
+    nbmsg* msg = (void*)w->ctl;
+
+    msg->magic = NB_MAGIC;
+    msg->cookie = xcookie;
+    msg->cmd = cmd;
+    msg->arg = arg;
+    memcpy(msg->data, data, len);
+    w->ctllen = sizeof(nbmsg) + len;
+    w->cookie = xcookie;
+    w->retries = RETRIES;
+    w->when = now();
+    w->deadline = expiry(s, w);
+    xsend(&s->addr, w->ctl, w->ctllen);
+}
+
+// blocks to a parity group (-f), or whether to go by how many a target
+// loses
+static uint32_t fec = 0;
+static int fec_auto = 0;
+
+#define FEC_MIN 4
+#define FEC_MAX 32
+#define FEC_DEFAULT 16
+
+// How many blocks to send a parity block for, to a target that loses
+// loss in a million. Each one rebuilds one lost block, so the groups
+// are made small enough that few lose two: about one in five groups
+// loses a block. Below one in 500, resends are cheaper.
+static uint32_t fec_pick(int loss) {
+    uint32_t n;
+
+    if (!fec_auto) {
+        return fec;
+    }
+    if (loss < 0) {
+        return FEC_DEFAULT;
+    }
+    if (loss < 2000) {
+        return 0;
+    }
+    n = 200000 / loss;
+    return (n < FEC_MIN) ? FEC_MIN : (n > FEC_MAX) ? FEC_MAX : n;
+}
+
+// The most any member of a group is known to lose (see session.loss)
+static int group_loss(group* g) {
+    int loss = -1;
+
+    for (session* s = sessions; s != NULL; s = s->next) {
+        if ((s->grp == g) && (s->loss > loss)) {
+            loss = s->loss;
+        }
+    }
+    return loss;
+}
+
+// The group a file is pushed to, if any
+static group* xfer_group(xfer* x) {
+    return x->solo ? NULL : x->s->grp;
+}
+
+static void xfer_open(xfer* x) {
+    session* s = x->s;
+    group* g = xfer_group(x);
+    int i = x - s->xfers;
+    uint32_t arg = s->window;
+    uint32_t xcookie;
+
+    // every member of a group shares the cookie, so it matches the
+    // group's data, and the parity the leader picks for it (groups of
+    // blocks must fit in the window of whoever paces the data)
+    x->fec = (s->fec && (g == NULL)) ? fec_pick(s->loss) : 0;
+    if (g) {
+        xcookie = g->file[i].cookie;
+        if (g->file[i].leader == NULL) {
+            g->file[i].leader = x;
+            if (g->fec) {
+                x->fec = fec_pick(group_loss(g));
+                g->file[i].fec = (x->fec < s->window) ? x->fec : s->window;
+            }
+            arg |= NB_FILE_LEADER;
+        }
+        x->fec = g->file[i].fec;
+    } else {
+        xcookie = cookie++;
+        if (x->fec > s->window) {
+            x->fec = s->window;
+        }
+    }
+    // a resumed or wide file is sent as is, as is one with parity
+    if (x->wide) {
+        arg |= NB_FILE_WIDE;
+    }
+    if (x->fec) {
+        arg |= NB_FILE_FEC;
+    }
+    if (x->from) {
+        arg |= NB_FILE_RESUME;
+    } else if (!x->wide && !x->fec) {
+        if (s->lz4 && image_lz4(x->img)) {
+            arg |= NB_FILE_LZ4;
+        }
+        // each target of a push would need a delta of its own
+        if ((g == NULL) && (s->window >= 2)) {
+            arg |= NB_FILE_DELTA;
+        }
+    }
+    // the name, then its options
+    char data[256];
+    size_t len = strlen(x->name) + 1;
+    memcpy(data, x->name, len);
+    if (s->crc) {
+        len += sprintf(data + len, "crc32c") + 1;
+        len += sprintf(data + len, "%u", image_crc(x->img)) + 1;
+    }
+    if (s->sized) {
+        len += sprintf(data + len, "size") + 1;
+        len += sprintf(data + len, "%zu", x->img->size) + 1;
+    }
+    if (x->from) {
+        len += sprintf(data + len, "offset") + 1;
+        len += sprintf(data + len, "%llu", (unsigned long long)x->from) + 1;
+    }
+    if (x->fec) {
+        len += sprintf(data + len, "fec") + 1;
+        len += sprintf(data + len, "%u", x->fec) + 1;
+    }
+    x->state = X_SEND_FILE;
+    send_ctl(s, &x->w, NB_SEND_FILE, arg, data, len, xcookie);
+}
+
+// Ask a bootloader that can resume how much of the file it holds first,
+// in case an earlier transfer of it broke off
+static void xfer_start(xfer* x) {
+    session* s = x->s;
+
+    x->begun = now();
+    x->from = 0;
+    x->wide = x->img->size > UINT32_MAX;
+    if (x->wide && !s->wide) {
+        char why[192];
+        snprintf(why, sizeof(why), "'%s' is too large for the target", x->name);
+        session_fail(s, why);
+        return;
+    }
+    if (s->resume && (s->grp == NULL)) {
+        x->state = X_QUERY;
+        send_ctl(s, &x->w, NB_QUERY, 0, x->name, strlen(x->name) + 1, cookie++);
+        return;
+    }
+    xfer_open(x);
+}
+
+// Resume from the last whole block the bootloader holds, if what it
+// holds is the start of this file
+static void query_ack(xfer* x, nbmsg* ack, size_t len) {
+    const char* val = adv_get(ack, len, "crc32c");
+    const char* off = adv_get(ack, len, "offset");
+    uint64_t held = off ? strtoull(off, NULL, 10) : ack->arg;
+
+    if ((held > 0) && (held <= x->img->size) && val &&
+        (strtoul(val, NULL, 10) == crc32c(0, x->img->data, held))) {
+        x->from = held - (held % block_len(x));
+    }
+    if (x->from) {
+        fprintf(stderr, "\n%s: [%s] resuming '%s' at %llu of %zu bytes\n", appname,
+                x->s->name, x->name, (unsigned long long)x->from, x->img->size);
+    }
+    xfer_open(x);
+}
+
+// Start the session's next file once every earlier one has all of its
+// data out, so that its handshake overlaps their tail, if the bootloader
+// has room for another. Boot as soon as the last one is in.
+static void session_next(session* s) {
+    int active = 0;
+
+    if (s->state != S_FILES) {
+        return;
+    }
+    for (int i = 0; i < s->opened; i++) {
+        xfer* x = s->xfers + i;
+        if ((x->state == X_QUERY) || (x->state == X_SEND_FILE) || (x->state == X_INDEX) ||
+            ((x->state == X_DATA) && (x->sent < x->nblocks))) {
+            return;
+        }
+        if (x->state != X_DONE) {
+            active++;
+        }
+    }
+    if (s->opened < s->count) {
+        if (active < s->files) {
+            xfer_start(s->xfers + s->opened++);
+        }
+        return;
+    }
+    if (active == 0) {
+        if (s->stats) {
+            s->state = S_STATS;
+            send_ctl(s, &s->w, NB_STATS, 0, NULL, 0, cookie++);
+            return;
+        }
+        s->state = S_BOOT;
+        send_ctl(s, &s->w, NB_BOOT, 0, NULL, 0, cookie++);
+    }
+}
+
+static void group_free(group* g) {
+    if (--g->members == 0) {
+        free(g);
+    }
+}
+
+// A file's push to the group is over; repair the members that were not
+// pacing it
+static void group_pushed(group* g, int i) {
+    for (session* s = sessions; s != NULL; s = s->next) {
+        if ((s->grp == g) && (s->xfers[i].state == X_READY)) {
+            start_data(s->xfers + i);
+        }
+    }
+}
+
+// Once every member is ready for a file, push it to the group
+static void group_check(group* g, int i) {
+    xfer* x;
+
+    if ((g->file[i].joining > 0) || g->file[i].started) {
+        return;
+    }
+    g->file[i].started = 1;
+    if ((x = g->file[i].leader) == NULL) {
+        // nobody acks group data, so repair everyone from scratch
+        group_pushed(g, i);
+        return;
+    }
+    fprintf(stderr, "%s: multicasting '%s' to %d targets...\n", appname,
+            x->name, g->members);
+    g->addr.sin6_scope_id = x->s->addr.sin6_scope_id;
+    start_data(x);
+}
+
+// Take a session out of its group, so that no push waits on it
+static void group_leave(session* s) {
+    group* g = s->grp;
+
+    s->grp = NULL;
+    for (int i = 0; i < s->count; i++) {
+        xfer* x = s->xfers + i;
+        int pushing = 0;
+        if (x->solo) {
+            continue;
+        }
+        if (g->file[i].leader == x) {
+            g->file[i].leader = NULL;
+            pushing = (x->state == X_DATA);
+        }
+        if ((x->state == X_IDLE) || (x->state == X_SEND_FILE)) {
+            g->file[i].joining--;
+            group_check(g, i);
+        } else if (pushing) {
+            group_pushed(g, i);
+        }
+    }
+    group_free(g);
+}
+
+// Take a file out of its group's push, for a target that cannot take the
+// form the group is sent, and send it by unicast as it can take it. (It
+// gets a cookie of its own, so the push passes it by.)
+static void xfer_solo(xfer* x) {
+    session* s = x->s;
+    group* g = s->grp;
+    int i = x - s->xfers;
+
+    fprintf(stderr, "%s: [%s] sending '%s' by unicast...\n", appname, s->name, x->name);
+    x->solo = 1;
+    if (g->file[i].leader == x) {
+        g->file[i].leader = NULL;
+    }
+    g->file[i].joining--;
+    group_check(g, i);
+    xfer_open(x);
+}
+
+static void session_fail(session* s, const char* why) {
+    fprintf(stderr, "\n%s: [%s] %s\n", appname, s->name, why);
+    if (s->grp) {
+        group_leave(s);
+        if (s->state == S_JOIN) {
+            fprintf(stderr, "%s: [%s] sending by unicast...\n", appname, s->name);
+            s->state = S_FILES;
+            s->w.deadline = 0;
+            session_next(s);
+            return;
+        }
+    }
+    s->state = S_FAILED;
+    s->w.deadline = 0;
+    for (int i = 0; i < s->count; i++) {
+        s->xfers[i].w.deadline = 0;
+    }
+    session_report(s);
+}
+
+// Free what a file needed while it was being sent
+static void xfer_free(xfer* x) {
+    free(x->tx);
+    free(x->have);
+    free(x->acked);
+    free(x->boff);
+    free(x->bpos);
+    x->tx = NULL;
+    x->have = NULL;
+    x->acked = NULL;
+    x->boff = NULL;
+    x->bpos = NULL;
+}
+
+// How many blocks in a million the files a session has sent lost on the
+// way, as far as it can tell: those resent, plus those rebuilt from
+// parity, which are only known once the bootloader has said. Returns -1
+// if nothing can be told yet.
+static int session_loss(session* s) {
+    uint64_t lost = 0;
+    uint64_t blocks = 0;
+
+    for (int i = 0; i < s->opened; i++) {
+        xfer* x = s->xfers + i;
+        if ((x->state == X_DONE) && (s->rx_stats || !x->parities)) {
+            lost += x->resent + x->rx_recovered;
+            blocks += x->nblocks;
+        }
+    }
+    if (blocks == 0) {
+        return -1;
+    }
+    return (lost < blocks) ? (lost * 1000000 / blocks) : 1000000;
+}
+
+static void xfer_done(xfer* x) {
+    session* s = x->s;
+    int i = x - s->xfers;
+    int pushing = xfer_group(x) && (s->grp->file[i].leader == x) && (x->state == X_DATA);
+    int loss;
+
+    xfer_free(x);
+    x->ended = now();
+    x->state = X_DONE;
+    x->w.deadline = 0;
+    // a session only learns that a target loses more than it was
+    // thought to
+    if ((loss = session_loss(s)) > s->loss) {
+        s->loss = loss;
+    }
+    if (pushing) {
+        group_pushed(s->grp, i);
+    }
+    session_next(s);
+}
+
+// Send blocks until the window is full. Acks are cumulative and list
+// the ranges the bootloader holds past the first hole, so only the
+// blocks it is actually missing get sent again. A timeout resends every
+// block in flight that has not been acknowledged.
+//
+// With parity, each group of blocks is followed by its parity block, and
+// a block that goes missing is not given up on before the parity has had
+// the chance to rebuild it.
+static void window_fill(xfer* x) {
+    uint64_t t0 = now();
+
+    while ((x->sent < x->nblocks) && ((x->sent - x->base) < x->window)) {
+        txblock* t = x->tx + (x->sent % x->window);
+        t->seq = ++x->seq;
+        t->sacked = 0;
+        t->when = t0;
+        t->last = t0;
+        send_block(x, x->dst, x->sent++);
+        if (x->fec && (group_end(x, x->sent - 1) == (x->sent - 1))) {
+            uint32_t n = x->sent - 1;
+            send_parity(x, x->dst, n);
+            x->seq++;
+            for (n -= n % x->fec; n < x->sent; n++) {
+                if (n >= x->base) {
+                    x->tx[n % x->window].parity = x->seq;
+                }
+            }
+        }
+    }
+}
+
+static void window_resend(xfer* x) {
+    for (uint32_t n = x->base; n < x->sent; n++) {
+        txblock* t = x->tx + (n % x->window);
+        if (t->sacked) {
+            continue;
+        }
+        t->seq = ++x->seq;
+        t->when = 0;
+        t->last = now();
+        x->resent++;
+        send_block(x, x->dst, n);
+    }
+}
+
+// The newest block an ack newly covers is most likely the one that
+// prompted it, so its round trip is timed, unless it was ever resent
+// (as then it can't be told which send arrived).
+static void window_time(txblock* t, txblock** newest) {
+    if ((*newest == NULL) || ((*newest)->seq < t->seq)) {
+        *newest = t;
+    }
+}
+
+// Work out the offset an ack has everything before, and the ranges it
+// lists as held past that (at most NB_MAX_SACK). Returns how many, or -1
+// if a wide ack is missing the high half of its offset.
+static int ack_ranges(xfer* x, nbmsg* ack, size_t len, uint64_t* off, nbrange64* sack) {
+    uint8_t* p = ack->data;
+    uint32_t hi = 0;
+    size_t size = x->wide ? sizeof(nbrange64) : sizeof(nbrange);
+    size_t count;
+
+    len -= sizeof(nbmsg);
+    if (x->wide) {
+        if (len < sizeof(uint32_t)) {
+            return -1;
+        }
+        memcpy(&hi, p, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+    }
+    *off = ((uint64_t)hi << 32) | ack->arg;
+    if ((count = len / size) > NB_MAX_SACK) {
+        count = NB_MAX_SACK;
+    }
+    for (size_t i = 0; i < count; i++, p += size) {
+        if (x->wide) {
+            memcpy(sack + i, p, sizeof(nbrange64));
+        } else {
+            nbrange r;
+            memcpy(&r, p, sizeof(nbrange));
+            sack[i].start = r.start;
+            sack[i].end = r.end;
+        }
+    }
+    return count;
+}
+
+// Note that block n has arrived, and with it (as far as can be told)
+// every block sent before it over the same port. That only holds for a
+// block sent once: the ack of one that was resent may be for its late
+// original, sent before blocks that are still in flight (Karn's rule).
+// One acked sooner than a round trip after it was resent was, and so
+// was resent for nothing: blocks are given longer to arrive from then on.
+static void window_delivered(xfer* x, txblock* t, uint32_t n) {
+    int port = block_port(x, x->dst, n);
+    uint64_t srtt = x->s->srtt;
+
+    if (t->when) {
+        if (x->delivered[port] < t->seq) {
+            x->delivered[port] = t->seq;
+        }
+    } else if (x->rtts && ((now() - t->last) < x->rtt_min)) {
+        x->reorder = ((x->reorder + srtt / 4) < srtt) ? (x->reorder + srtt / 4) : srtt;
+    }
+}
+
+// Resend the blocks presumed lost. Returns when the next of those that
+// were overtaken, but may still arrive, is to be presumed lost (or 0).
+static uint64_t window_lost(xfer* x) {
+    uint64_t t0 = now();
+    uint64_t srtt = x->s->srtt;
+    uint64_t wait = srtt + ((x->reorder > (srtt / 4)) ? x->reorder : (srtt / 4));
+    uint64_t due = 0;
+    txblock* t;
+    int port;
+
+    for (uint32_t n = x->base; n < x->sent; n++) {
+        t = x->tx + (n % x->window);
+        port = block_port(x, x->dst, n);
+        if (t->sacked || ((t->seq + DUPTHRESH) > x->delivered[port])) {
+            continue;
+        }
+        // (nor before its parity is out, and should have arrived)
+        if (x->fec && ((group_end(x, n) >= x->sent) ||
+                       ((t->parity + DUPTHRESH) > x->delivered[port]))) {
+            continue;
+        }
+        if ((t0 - t->last) < wait) {
+            if ((due == 0) || ((t->last + wait) < due)) {
+                due = t->last + wait;
+            }
+            continue;
+        }
+        fprintf(stderr, "R");
+        t->seq = ++x->seq;
+        t->when = 0;
+        t->last = t0;
+        x->resent++;
+        send_block(x, x->dst, n);
+    }
+    return due;
+}
+
+// Wait for an ack until the timeout, or until blocks that were overtaken
+// are due to be presumed lost, if that is sooner
+static void window_wait(xfer* x, uint64_t due) {
+    x->w.deadline = expiry(x->s, &x->w);
+    x->recheck = due && (due < x->w.deadline);
+    if (x->recheck) {
+        x->w.deadline = due;
+    }
+}
+
+static void window_ack(xfer* x, nbmsg* ack, size_t len) {
+    size_t blksz = block_len(x);
+    txblock* newest = NULL;
+    nbrange64 sack[NB_MAX_SACK];
+    uint64_t off;
+    uint64_t due;
+    txblock* t;
+    int count;
+
+    if ((count = ack_ranges(x, ack, len, &off, sack)) < 0) {
+        fprintf(stderr, "A");
+        return;
+    }
+    uint32_t acked = block_at(x, off);
+    while ((x->base < acked) && (x->base < x->sent)) {
+        t = x->tx + (x->base % x->window);
+        if (!t->sacked) {
+            window_time(t, &newest);
+        }
+        window_delivered(x, t, x->base);
+        x->base++;
+        x->w.retries = RETRIES;
+        tick(blksz);
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint32_t n = block_from(x, sack[i].start);
+        uint32_t end = block_at(x, sack[i].end);
+        if (n < x->base) {
+            n = x->base;
+        }
+        for (; (n < end) && (n < x->sent); n++) {
+            t = x->tx + (n % x->window);
+            if (!t->sacked) {
+                t->sacked = 1;
+                window_time(t, &newest);
+                x->w.retries = RETRIES;
+                window_delivered(x, t, n);
+            }
+        }
+    }
+    if (newest && newest->when) {
+        rtt_sample(x->s, x, now() - newest->when);
+    }
+
+    due = window_lost(x);
+    if (x->base == x->nblocks) {
+        xfer_done(x);
+        return;
+    }
+    window_fill(x);
+    window_wait(x, due);
+    session_next(x->s);
+}
+
+// In lockstep each block is a message of its own, acked with its offset
+static void lockstep_send(xfer* x) {
+    // only a block that has not timed out yet can be timed
+    x->w.when = (x->w.retries == RETRIES) ? now() : 0;
+    send_block(x, &x->s->addr, x->base);
+    x->w.deadline = expiry(x->s, &x->w);
+}
+
+static void lockstep_ack(xfer* x, nbmsg* ack) {
+    size_t blksz = block_len(x);
+
+    // (a wide file's ack has the low half of the offset, which is enough
+    // with one block in flight)
+    if (ack->arg != (uint32_t)(x->base * blksz)) {
+        fprintf(stderr, "A");
+        return;
+    }
+    if (x->w.when) {
+        rtt_sample(x->s, x, now() - x->w.when);
+    }
+    tick(blksz);
+    x->w.retries = RETRIES;
+    if (++x->base == x->nblocks) {
+        xfer_done(x);
+        return;
+    }
+    x->w.cookie = cookie++;
+    lockstep_send(x);
+}
+
+// Fill in whatever a target is still missing after a multicast push.
+// Each round resends up to window missing blocks, and the newest ack they
+// produce lists the holes that remain. The final block is used as a
+// probe whenever the picture is unknown, since any block gets an ack.
+static void repair_probe(xfer* x) {
+    send_block(x, &x->s->addr, x->nblocks - 1);
+    x->snaplen = 0;
+    x->pending = 1;
+    x->w.deadline = expiry(x->s, &x->w);
+}
+
+static void repair_round(xfer* x) {
+    nbrange64 sack[NB_MAX_SACK];
+    uint64_t fsize = x->size;
+    uint64_t hole;
+    int count;
+
+    // (only acks that passed ack_ranges() are kept)
+    count = ack_ranges(x, (void*)x->snap, x->snaplen, &hole, sack);
+
+    // holes lie between the acked prefix and the listed ranges, and
+    // past the last range only if the list was not cut short
+    x->pending = 0;
+    for (int i = 0; (i <= count) && (x->pending < x->window); i++) {
+        uint64_t end;
+        if (i < count) {
+            end = sack[i].start;
+        } else if (count < NB_MAX_SACK) {
+            end = fsize;
+        } else {
+            break;
+        }
+        for (uint32_t n = block_at(x, hole);
+             (block_off(x, n) < end) && (x->pending < x->window); n++) {
+            fprintf(stderr, "R");
+            x->resent++;
+            send_block(x, &x->s->addr, n);
+            x->pending++;
+        }
+        if (i < count) {
+            hole = sack[i].end;
+        }
+    }
+    if (x->pending == 0) {
+        repair_probe(x);
+        return;
+    }
+    x->snaplen = 0;
+    x->w.deadline = expiry(x->s, &x->w);
+}
+
+static void repair_ack(xfer* x, nbmsg* ack, size_t len) {
+    nbrange64 sack[NB_MAX_SACK];
+    uint64_t off;
+
+    if (ack_ranges(x, ack, len, &off, sack) < 0) {
+        fprintf(stderr, "A");
+        return;
+    }
+    if (off >= x->size) {
+        xfer_done(x);
+        return;
+    }
+    // keep the newest ack; once one is in, don't sit out a full
+    // timeout for any that were lost
+    if (len > sizeof(x->snap)) {
+        len = sizeof(x->snap);
+    }
+    memcpy(x->snap, ack, len);
+    x->snaplen = len;
+    x->w.retries = RETRIES;
+    if ((x->pending == 0) || (--x->pending == 0)) {
+        repair_round(x);
+    } else {
+        x->w.deadline = now() + QUIET;
+    }
+}
+
+// A delta starts with the list of the file's chunks, NB_MAX_CHUNKS to a
+// message and up to window messages in flight. The acks say which chunks
+// the bootloader has, and once they are all in the rest are sent.
+static void index_send(xfer* x, uint32_t k) {
+    uint8_t buf[sizeof(nbmsg) + NB_MAX_CHUNKS * sizeof(nbchunk)];
+    nbmsg* msg = (void*)buf;
+    size_t first = k * NB_MAX_CHUNKS;
+    size_t count = x->img->nchunks - first;
+
+    if (count > NB_MAX_CHUNKS) {
+        count = NB_MAX_CHUNKS;
+    }
+    msg->magic = NB_MAGIC;
+    msg->cookie = x->w.cookie;
+    msg->cmd = NB_CHUNKS;
+    msg->arg = first;
+    memcpy(msg->data, x->img->chunks + first, count * sizeof(nbchunk));
+    xsend(&x->s->addr, msg, sizeof(nbmsg) + count * sizeof(nbchunk));
+}
+
+static void index_fill(xfer* x) {
+    while ((x->isent < x->nmsgs) && ((x->isent - x->ibase) < x->window)) {
+        index_send(x, x->isent++);
+    }
+    x->w.deadline = expiry(x->s, &x->w);
+}
+
+static void index_resend(xfer* x) {
+    for (uint32_t k = x->ibase; k < x->isent; k++) {
+        if (!x->acked[k]) {
+            index_send(x, k);
+        }
+    }
+    x->w.deadline = expiry(x->s, &x->w);
+}
+
+// Lay the chunks the bootloader lacks end to end, cut into blocks that
+// fit blksz along with their file offset, and send them
+static void delta_start(xfer* x) {
+    nbchunk* c = x->img->chunks;
+    size_t room = x->s->blksz - sizeof(uint32_t);
+    size_t total = 0;
+    uint32_t n = 0;
+
+    for (size_t i = 0; i < x->img->nchunks; i++) {
+        if (!(x->have[i / 8] & (1 << (i % 8)))) {
+            n += (c[i].len + room - 1) / room;
+            total += c[i].len;
+        }
+    }
+    x->boff = calloc(n + 1, sizeof(uint32_t));
+    x->bpos = calloc(n + 1, sizeof(uint32_t));
+    if ((x->boff == NULL) || (x->bpos == NULL)) {
+        session_fail(x->s, "out of memory");
+        return;
+    }
+    x->nblocks = n;
+    x->size = total;
+    n = 0;
+    total = 0;
+    for (size_t i = 0; i < x->img->nchunks; i++) {
+        if (x->have[i / 8] & (1 << (i % 8))) {
+            continue;
+        }
+        for (size_t off = 0; off < c[i].len; off += room, n++) {
+            x->boff[n] = total;
+            x->bpos[n] = c[i].offset + off;
+            total += ((c[i].len - off) < room) ? (c[i].len - off) : room;
+        }
+    }
+    x->boff[n] = total;
+    fprintf(stderr, "\n%s: [%s] '%s' is missing %zu of %zu bytes\n", appname,
+            x->s->name, x->name, x->size, x->img->size);
+    start_data(x);
+}
+
+static void index_ack(xfer* x, nbmsg* ack, size_t len) {
+    uint32_t k = ack->arg / NB_MAX_CHUNKS;
+
+    if ((ack->arg % NB_MAX_CHUNKS) || (k >= x->isent) ||
+        (len < (sizeof(nbmsg) + NB_MAX_CHUNKS / 8))) {
+        fprintf(stderr, "A");
+        return;
+    }
+    if (!x->acked[k]) {
+        x->acked[k] = 1;
+        memcpy(x->have + k * (NB_MAX_CHUNKS / 8), ack->data, NB_MAX_CHUNKS / 8);
+        x->w.retries = RETRIES;
+    }
+    while ((x->ibase < x->isent) && x->acked[x->ibase]) {
+        x->ibase++;
+    }
+    if (x->ibase == x->nmsgs) {
+        delta_start(x);
+        return;
+    }
+    index_fill(x);
+}
+
+static void index_start(xfer* x) {
+    x->nmsgs = (x->img->nchunks + NB_MAX_CHUNKS - 1) / NB_MAX_CHUNKS;
+    x->have = calloc(x->nmsgs + 1, NB_MAX_CHUNKS / 8);
+    x->acked = calloc(x->nmsgs + 1, 1);
+    if ((x->have == NULL) || (x->acked == NULL)) {
+        session_fail(x->s, "out of memory");
+        return;
+    }
+    x->ibase = 0;
+    x->isent = 0;
+    x->w.retries = RETRIES;
+    if (x->nmsgs == 0) {
+        delta_start(x);
+        return;
+    }
+    x->state = X_INDEX;
+    index_fill(x);
+}
+
+static void start_data(xfer* x) {
+    session* s = x->s;
+    int i = x - s->xfers;
+
+    if (x->boff == NULL) {
+        x->nblocks = (x->size + block_len(x) - 1) / block_len(x);
+    }
+    x->base = x->from / block_len(x);
+    x->sent = x->base;
+    x->seq = 0;
+    memset(x->delivered, 0, sizeof(x->delivered));
+    x->reorder = 0;
+    x->recheck = 0;
+    x->w.retries = RETRIES;
+    x->dst = &s->addr;
+    if (x->base == x->nblocks) {
+        xfer_done(x);
+        return;
+    }
+    if (xfer_group(x) && (s->grp->file[i].leader != x)) {
+        x->state = X_REPAIR;
+        repair_probe(x);
+        return;
+    }
+    x->state = X_DATA;
+    if (x->window < 2) {
+        x->w.cookie = cookie++;
+        lockstep_send(x);
+        return;
+    }
+    if ((x->tx = calloc(x->window, sizeof(txblock))) == NULL) {
+        session_fail(s, "out of memory");
+        return;
+    }
+    if (xfer_group(x)) {
+        x->dst = &s->grp->addr;
+    }
+    window_fill(x);
+    x->w.deadline = expiry(x->s, &x->w);
+    session_next(s);
+}
+
+static void xfer_ack(xfer* x, nbmsg* ack, size_t len) {
+    session* s = x->s;
+
+    switch (x->state) {
+    case X_QUERY:
+        if (x->w.when) {
+            rtt_sample(s, x, now() - x->w.when);
+        }
+        query_ack(x, ack, len);
+        return;
+    case X_SEND_FILE:
+        if (x->w.when) {
+            rtt_sample(s, x, now() - x->w.when);
+        }
+        if (!(ack->arg & NB_FILE_RESUME)) {
+            x->from = 0;
+        }
+        if (x->wide && !(ack->arg & NB_FILE_WIDE)) {
+            session_fail(s, "target cannot take a file of 4GB or more");
+            return;
+        }
+        // the bootloader may grant a smaller window than requested, and
+        // may not have a copy to take a delta against or room to take
+        // the file compressed, nor take parity
+        x->window = ack->arg & NB_WINDOW_MASK;
+        if (!(ack->arg & NB_FILE_FEC) || (x->fec > x->window)) {
+            x->fec = 0;
+        }
+        if (ack->arg & ((nbmsg*)x->w.ctl)->arg & NB_FILE_DELTA) {
+            if (image_chunks(x->img)) {
+                session_fail(s, "out of memory");
+                return;
+            }
+            x->data = x->img->data;
+            x->size = x->img->size;
+            index_start(x);
+            return;
+        }
+        if (ack->arg & ((nbmsg*)x->w.ctl)->arg & NB_FILE_LZ4) {
+            x->data = x->img->lz4;
+            x->size = x->img->lz4size;
+        } else if (xfer_group(x) && (((nbmsg*)x->w.ctl)->arg & NB_FILE_LZ4)) {
+            // the group is sent one form of the file
+            xfer_solo(x);
+            return;
+        } else {
+            x->data = x->img->data;
+            x->size = x->img->size;
+        }
+        if (xfer_group(x) == NULL) {
+            start_data(x);
+            return;
+        }
+        x->state = X_READY;
+        x->w.deadline = 0;
+        s->grp->file[x - s->xfers].joining--;
+        group_check(s->grp, x - s->xfers);
+        session_next(s);
+        return;
+    case X_INDEX:
+        index_ack(x, ack, len);
+        return;
+    case X_DATA:
+        if (x->tx) {
+            window_ack(x, ack, len);
+        } else {
+            lockstep_ack(x, ack);
+        }
+        return;
+    case X_REPAIR:
+        repair_ack(x, ack, len);
+        return;
+    }
+}
+
+static void session_ack(session* s, nbmsg* ack, size_t len) {
+    nbmsg* msg = (void*)s->w.ctl;
+    xfer* x = NULL;
+
+    if ((s->state != S_JOIN) && (s->state != S_STATS) && (s->state != S_BOOT)) {
+        msg = NULL;
+    }
+    if ((msg == NULL) || (ack->cookie != s->w.cookie)) {
+        for (int i = 0; i < s->opened; i++) {
+            if ((s->xfers[i].w.deadline != 0) && (s->xfers[i].w.cookie == ack->cookie)) {
+                x = s->xfers + i;
+                break;
+            }
+        }
+        if (x == NULL) {
+            fprintf(stderr, "C");
+            return;
+        }
+    }
+    if ((ack->cmd == NB_ERROR_BAD_CRC) && (x == NULL)) {
+        session_fail(s, "boot refused, a file arrived corrupt");
+        return;
+    }
+    if (ack->cmd != NB_ACK) {
+        char why[192];
+        if (x && (ack->cmd == NB_ERROR_TOO_LARGE)) {
+            snprintf(why, sizeof(why), "'%s' is too large for the target", x->name);
+        } else {
+            snprintf(why, sizeof(why), "transfer rejected (%08x)", ack->cmd);
+        }
+        session_fail(s, why);
+        return;
+    }
+    if (x) {
+        xfer_ack(x, ack, len);
+        return;
+    }
+    if (ack->arg != msg->arg) {
+        fprintf(stderr, "A");
+        return;
+    }
+    if (s->w.when) {
+        rtt_sample(s, NULL, now() - s->w.when);
+    }
+    if (s->state == S_JOIN) {
+        s->state = S_FILES;
+        s->w.deadline = 0;
+        session_next(s);
+        return;
+    }
+    if (s->state == S_STATS) {
+        stats_recv(s, ack, len);
+        s->state = S_BOOT;
+        send_ctl(s, &s->w, NB_BOOT, 0, NULL, 0, cookie++);
+        return;
+    }
+    size_t total = 0, wire = 0;
+    for (int i = 0; i < s->count; i++) {
+        total += s->xfers[i].img->size;
+        wire += s->xfers[i].size;
+    }
+    if (wire != total) {
+        fprintf(stderr, "\n%s: [%s] sent boot command (%zu bytes as %zu in %llu ms)\n",
+                appname, s->name, total, wire,
+                (unsigned long long)(now() - s->started) / 1000);
+    } else {
+        fprintf(stderr, "\n%s: [%s] sent boot command (%zu bytes in %llu ms)\n",
+                appname, s->name, total, (unsigned long long)(now() - s->started) / 1000);
+    }
+    s->state = S_DONE;
+    session_report(s);
+    s->w.deadline = 0;
+}
+
+static void session_timeout(session* s) {
+    s->w.deadline = 0;
+    s->w.when = 0;
+    if (--s->w.retries == 0) {
+        session_fail(s, "timed out");
+        return;
+    }
+    fprintf(stderr, "T");
+    xsend(&s->addr, s->w.ctl, s->w.ctllen);
+    s->w.deadline = expiry(s, &s->w);
+}
+
+static void xfer_timeout(xfer* x) {
+    x->w.deadline = 0;
+    if ((x->state == X_REPAIR) && x->snaplen) {
+        repair_round(x);
+        return;
+    }
+    if ((x->state == X_DATA) && x->recheck) {
+        window_wait(x, window_lost(x));
+        return;
+    }
+    if (--x->w.retries == 0) {
+        session_fail(x->s, "timed out");
+        return;
+    }
+    fprintf(stderr, "T");
+    x->w.when = 0;
+    x->timeouts++;
+    switch (x->state) {
+    case X_INDEX:
+        index_resend(x);
+        return;
+    case X_DATA:
+        if (x->tx) {
+            window_resend(x);
+            window_wait(x, 0);
+        } else {
+            x->resent++;
+            lockstep_send(x);
+        }
+        return;
+    case X_REPAIR:
+        repair_probe(x);
+        return;
+    default:
+        xsend(&x->s->addr, x->w.ctl, x->w.ctllen);
+        x->w.deadline = expiry(x->s, &x->w);
+        return;
+    }
+}
+
+// Cap blksz to what can be sent on the target's link without
+// fragmenting on our side
+static size_t link_blksz(const struct sockaddr_in6* addr, size_t blksz) {
+    struct ifreq ifr;
+    size_t max;
+
+    memset(&ifr, 0, sizeof(ifr));
+    if (if_indextoname(addr->sin6_scope_id, ifr.ifr_name) == NULL) {
+        return blksz;
+    }
+    if (ioctl(xs, SIOCGIFMTU, &ifr) < 0) {
+        return blksz;
+    }
+    max = (ifr.ifr_mtu - 40 - 8 - sizeof(nbmsg)) & ~7;
+    return (max < blksz) ? max : blksz;
+}
+
+static void session_free(session* s) {
+    for (int i = 0; i < s->count; i++) {
+        image_put(s->xfers[i].img);
+        xfer_free(s->xfers + i);
+    }
+    free(s);
+}
+
+// a bootloader that has beaconed, and what it advertised
+typedef struct {
+    struct sockaddr_in6 addr;
+    struct sockaddr_in6 nics[NB_MAX_NICS];
+    int nnics;
+    uint32_t window;
+    uint32_t files;
+    size_t blksz;
+    int lz4;
+    int crc;
+    int stats;
+    int resume;
+    int sized;
+    int wide;
+    int fec;
+    const imageset* set; // the files it is to be sent
+} target;
+
+static session* session_new(const target* t) {
+    session* s;
+
+    if ((s = calloc(1, sizeof(session))) == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < t->set->count; i++) {
+        artifact* a = artifacts + t->set->first + i;
+        xfer* x = s->xfers + s->count;
+        if (a->path) {
+            if ((x->img = image_get(a->path)) == NULL) {
+                session_free(s);
+                return NULL;
+            }
+        } else {
+            x->img = a->img;
+            x->img->refs++;
+        }
+        x->s = s;
+        x->name = a->name;
+        s->count++;
+    }
+    s->addr = t->addr;
+    memcpy(s->nics, t->nics, sizeof(s->nics));
+    s->nnics = t->nnics;
+    inet_ntop(AF_INET6, &t->addr.sin6_addr, s->name, sizeof(s->name));
+    s->state = S_FILES;
+    s->window = t->window;
+    s->files = t->files;
+    s->blksz = t->blksz;
+    for (int i = 0; i < s->nnics; i++) {
+        s->blksz = link_blksz(s->nics + i, s->blksz);
+    }
+    s->lz4 = t->lz4;
+    s->crc = t->crc;
+    s->stats = t->stats;
+    s->resume = t->resume;
+    s->sized = t->sized;
+    s->wide = t->wide;
+    s->fec = t->fec;
+    s->loss = -1;
+    s->started = now();
+    s->rto = RTO;
+    s->next = sessions;
+    sessions = s;
+    return s;
+}
+
+// Find the session of the target addr is one of the ports of
+static session* session_find(const struct sockaddr_in6* addr) {
+    for (session* s = sessions; s != NULL; s = s->next) {
+        for (int i = 0; i < s->nnics; i++) {
+            if (!memcmp(&s->nics[i].sin6_addr, &addr->sin6_addr, sizeof(addr->sin6_addr)) &&
+                (s->nics[i].sin6_scope_id == addr->sin6_scope_id)) {
+                return s;
+            }
+        }
+    }
+    return NULL;
+}
+
+// In watch mode (or when the parity sent goes by loss), the targets that
+// have beaconed, so that one that beacons again (say, once it is power
+// cycled after a rebuild) starts where its last session left off
+#define MAXKNOWN 64
+
+typedef struct {
+    target t; // what it advertised last
+    uint64_t seen;
+    int waiting; // for the files it is to be sent to be read again
+
+    // the round trip time and loss its last session worked out, and
+    // the CRC of each file it last booted
+    uint64_t srtt;
+    int loss;
+    int booted;
+    uint32_t crcs[MAXFILES];
+} known;
+
+static int watch = 0;
+static known knowns[MAXKNOWN];
+static int known_count = 0;
+
+// Find a target by its address, or make room for it (in place of the
+// one heard from least recently, if need be)
+static known* known_find(const struct in6_addr* addr, int add) {
+    known* k;
+
+    for (int i = 0; i < known_count; i++) {
+        if (!memcmp(&knowns[i].t.addr.sin6_addr, addr, sizeof(*addr))) {
+            return knowns + i;
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    if (known_count < MAXKNOWN) {
+        k = knowns + known_count++;
+    } else {
+        k = knowns;
+        for (int i = 1; i < known_count; i++) {
+            if (knowns[i].seen < k->seen) {
+                k = knowns + i;
+            }
+        }
+    }
+    memset(k, 0, sizeof(*k));
+    k->t.addr.sin6_addr = *addr;
+    k->loss = -1;
+    return k;
+}
+
+// Start a session off with the round trip time of the target's last one,
+// rather than waiting on the first ack for as long as for a stranger, and
+// say which of its files have changed since it last booted
+static void known_resume(known* k, session* s) {
+    if (k->srtt) {
+        rtt_sample(s, NULL, k->srtt);
+    }
+    s->loss = k->loss;
+    if (!k->booted) {
+        return;
+    }
+    for (int i = 0; i < s->count; i++) {
+        if (image_crc(s->xfers[i].img) != k->crcs[i]) {
+            fprintf(stderr, "%s: [%s] '%s' has changed since it last booted\n", appname,
+                    s->name, s->xfers[i].name);
+        }
+    }
+}
+
+static void known_done(session* s) {
+    known* k = known_find(&s->addr.sin6_addr, fec_auto);
+
+    if (k == NULL) {
+        return;
+    }
+    if (k->seen == 0) {
+        k->seen = now();
+    }
+    k->srtt = s->srtt;
+    k->loss = session_loss(s);
+    k->booted = 1;
+    for (int i = 0; i < s->count; i++) {
+        k->crcs[i] = image_crc(s->xfers[i].img);
+    }
+}
+
+// Free the sessions that are over, and return how many there were
+static int session_reap(void) {
+    session** p = &sessions;
+    session* s;
+    int n = 0;
+
+    while ((s = *p) != NULL) {
+        if ((s->state != S_DONE) && (s->state != S_FAILED)) {
+            p = &s->next;
+            continue;
+        }
+        *p = s->next;
+        if (s->grp) {
+            group_leave(s);
+        }
+        if ((watch || fec_auto) && (s->state == S_DONE)) {
+            known_done(s);
+        }
+        session_free(s);
+        n++;
+    }
+    return n;
+}
 
-    msg->magic = NB_MAGIC;
-    msg->cookie = cookie++;
+// Handle the acks that are in, RXBATCH at a time, then any resends that
+// are due, and send whatever that queued. Returns how long (in ms) until
+// the next one is.
+static int session_poll(void) {
+    // (room for the largest ack, NB_STATS, and anything else is cut short)
+    static uint8_t buf[RXBATCH][sizeof(nbmsg) + NB_MAX_STATS];
+    static struct sockaddr_in6 ra[RXBATCH];
+    static struct iovec iov[RXBATCH];
+    static struct mmsghdr rx[RXBATCH];
+    session* s;
+    int r;
+    int i;
 
     for (;;) {
-        r = write(s, msg, len);
+        for (i = 0; i < RXBATCH; i++) {
+            iov[i].iov_base = buf[i];
+            iov[i].iov_len = sizeof(buf[i]);
+            memset(&rx[i], 0, sizeof(rx[i]));
+            rx[i].msg_hdr.msg_name = ra + i;
+            rx[i].msg_hdr.msg_namelen = sizeof(ra[i]);
+            rx[i].msg_hdr.msg_iov = iov + i;
+            rx[i].msg_hdr.msg_iovlen = 1;
+        }
+        r = recvmmsg(xs, rx, RXBATCH, MSG_DONTWAIT, NULL);
         if (r < 0) {
-            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                fprintf(stderr, "\n%s: socket read error %d\n", appname, errno);
+            }
+            break;
+        }
+        for (i = 0; i < r; i++) {
+            nbmsg* ack = (void*)buf[i];
+            if ((rx[i].msg_len < sizeof(nbmsg)) || (ack->magic != NB_MAGIC)) {
+                fprintf(stderr, "?");
                 continue;
             }
-            fprintf(stderr, "\n%s: socket write error %d\n", appname, errno);
-            return -1;
+            if ((s = session_find(ra + i)) == NULL) {
+                fprintf(stderr, "C");
+                continue;
+            }
+            session_ack(s, ack, rx[i].msg_len);
         }
-    again:
-        r = read(s, ack, 2048);
-        if (r < 0) {
-            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-                retries--;
-                if (retries > 0) {
-                    fprintf(stderr, "T");
-                    continue;
-                }
-                fprintf(stderr, "\n%s: timed out\n", appname);
-            } else {
-                fprintf(stderr, "\n%s: socket read error %d\n", appname, errno);
+        if (r < RXBATCH) {
+            break;
+        }
+    }
+
+    uint64_t t = now();
+    for (s = sessions; s != NULL; s = s->next) {
+        if (s->w.deadline && (s->w.deadline <= t)) {
+            session_timeout(s);
+        }
+        for (i = 0; i < s->opened; i++) {
+            if (s->xfers[i].w.deadline && (s->xfers[i].w.deadline <= t)) {
+                xfer_timeout(s->xfers + i);
             }
-            return -1;
         }
-        if (r < sizeof(nbmsg)) {
-            fprintf(stderr, "Z");
-            goto again;
+    }
+
+    txq_flush();
+
+    // timing out one session can set another's deadline
+    uint64_t next = 0;
+    for (s = sessions; s != NULL; s = s->next) {
+        if (s->w.deadline && ((next == 0) || (s->w.deadline < next))) {
+            next = s->w.deadline;
         }
-        if (ack->magic != NB_MAGIC) {
-            fprintf(stderr, "?");
-            goto again;
+        for (i = 0; i < s->opened; i++) {
+            uint64_t d = s->xfers[i].w.deadline;
+            if (d && ((next == 0) || (d < next))) {
+                next = d;
+            }
         }
-        if (ack->cookie != msg->cookie) {
-            fprintf(stderr, "C");
-            goto again;
+    }
+    if (next == 0) {
+        return -1;
+    }
+    t = now();
+    return (next > t) ? (next - t + 999) / 1000 : 0;
+}
+
+// Multicast each file once to every target that supports windowed
+// transfers, paced by the acks of one of them. Then fill in each of the
+// others' holes over unicast and boot them all. Targets that cannot
+// join get a unicast transfer of their own.
+static void push_group(target* list, int count) {
+    group* g;
+    session* s;
+    known* k;
+    int i;
+
+    if ((g = calloc(1, sizeof(group))) == NULL) {
+        return;
+    }
+    g->addr.sin6_family = AF_INET6;
+    g->addr.sin6_port = htons(NB_SERVER_PORT);
+    inet_pton(AF_INET6, NB_GROUP, &g->addr.sin6_addr);
+    g->blksz = MAXPACKET - sizeof(nbmsg);
+    g->lz4 = 1;
+    g->fec = 1;
+
+    for (target* t = list; t < (list + count); t++) {
+        if ((s = session_new(t)) == NULL) {
+            continue;
         }
-        if (ack->arg != msg->arg) {
-            fprintf(stderr, "A");
-            goto again;
+        if ((k = known_find(&t->addr.sin6_addr, 0)) != NULL) {
+            known_resume(k, s);
+        }
+        if (t->window < 2) {
+            fprintf(stderr, "%s: [%s] sending by unicast...\n", appname, s->name);
+            session_next(s);
+            continue;
+        }
+        s->grp = g;
+        s->state = S_JOIN;
+        g->members++;
+        if (s->blksz < g->blksz) {
+            g->blksz = s->blksz;
+        }
+        if (!s->lz4) {
+            g->lz4 = 0;
+        }
+        if (!s->fec) {
+            g->fec = 0;
         }
-        if (ack->cmd == NB_ACK)
-            return 0;
-        fprintf(stderr, "?");
-        goto again;
     }
+    if (g->members == 0) {
+        free(g);
+        return;
+    }
+    for (i = 0; i < sets[0].count; i++) {
+        g->file[i].cookie = cookie++;
+        g->file[i].joining = g->members;
+    }
+    for (s = sessions; s != NULL; s = s->next) {
+        if (s->grp == g) {
+            s->blksz = g->blksz;
+            s->lz4 = g->lz4;
+            send_ctl(s, &s->w, NB_JOIN_GROUP, 0, &g->addr.sin6_addr,
+                     sizeof(g->addr.sin6_addr), cookie++);
+        }
+    }
+}
+
+void usage(void) {
+    fprintf(stderr,
+            "usage:   %s [ <option> ]* <kernel> [ <ramdisk> ] [ -- [ <kernel cmdline> ]* ]\n"
+            "\n"
+            "options: -1  only boot once, then exit\n"
+            "         -w  largest window to use (in blocks, 0 for lockstep)\n"
+            "         -b  largest block size to use (in bytes)\n"
+            "         -m  wait for this many targets and multicast to them\n"
+            "         -z  compress files for targets that can take them so\n"
+            "         -f  send targets that can take it a parity block per this many\n"
+            "             blocks, or \"auto\" to go by how many they lose (files with\n"
+            "             parity are not compressed)\n"
+            "         -j  print a summary of each session as JSON on stdout\n"
+            "         -W  watch the files, and have each ready to send as soon as it changes\n"
+            "         -r  send the targets listed in this registry files of their own\n"
+            "\n"
+            "The kernel and ramdisk are sent as kernel.bin and ramdisk.bin.\n"
+            "Any file may be given as <name>=<file> to send it under another name.\n"
+            "\n"
+            "Each line of a registry is <key>=<value>, then files (and a cmdline)\n"
+            "given as above. A target that advertises that value for the key (such\n"
+            "as serialno, board, uuid or mac) is sent them, by the first line that\n"
+            "matches, and any other target the files given here, if there are any.\n",
+            appname);
+    exit(1);
 }
 
-static void xfer(struct sockaddr_in6* addr, const char* fn) {
-    char msgbuf[2048];
-    char ackbuf[2048];
+static uint32_t window = NB_MAX_WINDOW;
+static size_t blksz = MAXPACKET - sizeof(nbmsg);
+static target* group_list = NULL;
+static int group_size = 0;
+static int group_count = 0;
+static int compress = 0;
+
+// Take the ports a target lists in its "nics" key. Each is assumed to be
+// on the same link as the one it beaconed from, until it beacons itself.
+static void nics_get(target* t, const char* list) {
     char tmp[INET6_ADDRSTRLEN];
-    struct timeval tv;
-    nbmsg* msg = (void*)msgbuf;
-    nbmsg* ack = (void*)ackbuf;
-    FILE* fp;
-    int s, r;
-    int count = 0;
+    const char* end;
+    size_t n;
 
-    if ((fp = fopen(fn, "rb")) == NULL) {
+    t->nnics = 0;
+    while (list && (t->nnics < NB_MAX_NICS)) {
+        end = strchr(list, ',');
+        n = end ? (size_t)(end - list) : strlen(list);
+        if (n < sizeof(tmp)) {
+            memcpy(tmp, list, n);
+            tmp[n] = 0;
+            t->nics[t->nnics] = t->addr;
+            if (inet_pton(AF_INET6, tmp, &t->nics[t->nnics].sin6_addr) == 1) {
+                t->nnics++;
+            }
+        }
+        list = end ? (end + 1) : NULL;
+    }
+}
+
+// Note which link a target's other port beaconed on, for a session or a
+// group member that has it
+static void nic_heard(const struct sockaddr_in6* ra) {
+    for (session* s = sessions; s != NULL; s = s->next) {
+        for (int i = 1; i < s->nnics; i++) {
+            if (!memcmp(&s->nics[i].sin6_addr, &ra->sin6_addr, sizeof(ra->sin6_addr))) {
+                s->nics[i].sin6_scope_id = ra->sin6_scope_id;
+            }
+        }
+    }
+    for (int n = 0; n < group_count; n++) {
+        for (int i = 1; i < group_list[n].nnics; i++) {
+            if (!memcmp(&group_list[n].nics[i].sin6_addr, &ra->sin6_addr, sizeof(ra->sin6_addr))) {
+                group_list[n].nics[i].sin6_scope_id = ra->sin6_scope_id;
+            }
+        }
+    }
+}
+
+// Solicit bootloaders on every interface as soon as we start (or, in
+// watch mode, have new files), rather than wait on their next beacon,
+// which may be seconds off. SOLICITS are sent in case one is lost, the
+// first SOLICIT_GAP ms apart, then twice that, and so on.
+#define SOLICITS 4
+#define SOLICIT_GAP 50
+
+static int solicits;
+static uint64_t solicit_next;
+
+static void solicit_start(void) {
+    solicits = SOLICITS;
+    solicit_next = now();
+}
+
+// Send a solicit if one is due, and return how long (in ms) until the
+// next one is
+static int solicit(int s) {
+    struct if_nameindex* ifs;
+    struct sockaddr_in6 to;
+    uint64_t t = now();
+    nbmsg msg;
+
+    if (solicits == 0) {
+        return -1;
+    }
+    if (t < solicit_next) {
+        return (solicit_next - t + 999) / 1000;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.magic = NB_MAGIC;
+    msg.cmd = NB_SOLICIT;
+    memset(&to, 0, sizeof(to));
+    to.sin6_family = AF_INET6;
+    to.sin6_port = htons(NB_SERVER_PORT);
+    inet_pton(AF_INET6, "ff02::1", &to.sin6_addr);
+    // (interfaces that cannot multicast just fail to send it)
+    if ((ifs = if_nameindex()) != NULL) {
+        for (struct if_nameindex* i = ifs; i->if_index != 0; i++) {
+            to.sin6_scope_id = i->if_index;
+            sendto(s, &msg, sizeof(msg), 0, (void*)&to, sizeof(to));
+        }
+        if_freenameindex(ifs);
+    }
+    solicits--;
+    solicit_next = t + ((uint64_t)SOLICIT_GAP * 1000 << (SOLICITS - 1 - solicits));
+    return solicits ? SOLICIT_GAP << (SOLICITS - 1 - solicits) : -1;
+}
+
+// In watch mode, a file is read again as soon as it changes, by a worker
+// thread so that sessions carry on meanwhile. It maps the file and works
+// out everything a session could ask of it (its CRC, compressed form and
+// chunks), then hands it over to go in the cache. A target that beacons
+// while any file is being read is started once they all are.
+typedef struct {
+    int i; // the artifact it is a copy of
+    image* img; // or NULL, if it could not be read
+    uint64_t begun;
+} warmed;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending[MAXARTIFACTS]; // artifacts changed since the worker took them
+    int fd[2]; // a pipe the worker hands each image over on
+    int count; // images still to come (only kept by the main thread)
+} warm = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void* warm_worker(void* arg) {
+    struct stat st;
+    warmed w;
+    int fd;
+
+    for (;;) {
+        pthread_mutex_lock(&warm.lock);
+        for (;;) {
+            for (w.i = 0; (w.i < artifact_count) && !warm.pending[w.i]; w.i++)
+                ;
+            if (w.i < artifact_count) {
+                break;
+            }
+            pthread_cond_wait(&warm.cond, &warm.lock);
+        }
+        warm.pending[w.i] = 0;
+        pthread_mutex_unlock(&warm.lock);
+
+        w.begun = now();
+        w.img = NULL;
+        if ((fd = open(artifacts[w.i].path, O_RDONLY)) >= 0) {
+            if ((fstat(fd, &st) == 0) &&
+                ((w.img = image_map(artifacts[w.i].path, fd, &st)) != NULL)) {
+                image_crc(w.img);
+                if (compress) {
+                    image_lz4(w.img);
+                }
+                image_chunks(w.img);
+            }
+            close(fd);
+        }
+        if (write(warm.fd[1], &w, sizeof(w)) != sizeof(w)) {
+            fprintf(stderr, "%s: error: handing over '%s'\n", appname, artifacts[w.i].path);
+        }
+    }
+    return NULL;
+}
+
+// Have the worker read an artifact again
+static void warm_change(int i) {
+    pthread_mutex_lock(&warm.lock);
+    if (!warm.pending[i]) {
+        warm.pending[i] = 1;
+        warm.count++;
+    }
+    pthread_cond_signal(&warm.cond);
+    pthread_mutex_unlock(&warm.lock);
+}
+
+// Start a session for a target, or in watch mode, wait for the files it
+// is to be sent to be ready first
+static void session_start(const target* t) {
+    known* k = NULL;
+    session* s;
+
+    if (watch || fec_auto) {
+        k = known_find(&t->addr.sin6_addr, 1);
+        k->t = *t;
+        k->seen = now();
+    }
+    if (watch) {
+        if (warm.count) {
+            if (!k->waiting) {
+                fprintf(stderr, "%s: waiting for the files to be read\n", appname);
+            }
+            k->waiting = 1;
+            return;
+        }
+        k->waiting = 0;
+    }
+    if ((s = session_new(t)) == NULL) {
         return;
     }
-    if ((s = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-        fprintf(stderr, "%s: cannot create socket %d\n", appname, errno);
-        goto done;
+    fprintf(stderr, "%s: [%s] sending %d files...\n", appname, s->name, s->count);
+    if (t->set->key) {
+        fprintf(stderr, "%s: [%s] is registered as %s=%s\n", appname, s->name,
+                t->set->key, t->set->value);
     }
-    tv.tv_sec = 0;
-    tv.tv_usec = 250 * 1000;
-    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-    if (connect(s, (void*)addr, sizeof(*addr)) < 0) {
-        fprintf(stderr, "%s: cannot connect to [%s]%d\n", appname,
-                inet_ntop(AF_INET6, &addr->sin6_addr, tmp, sizeof(tmp)),
-                ntohs(addr->sin6_port));
-        goto done;
+    if (s->nnics > 1) {
+        fprintf(stderr, "%s: [%s] striping data over %d ports\n", appname, s->name, s->nnics);
     }
+    if (k) {
+        known_resume(k, s);
+    }
+    session_next(s);
+}
+
+// Take an image from the worker, and once none are to come, start the
+// targets waiting on them
+static void warm_done(void) {
+    warmed w;
+
+    if (read(warm.fd[0], &w, sizeof(w)) != sizeof(w)) {
+        return;
+    }
+    warm.count--;
+    if (w.img) {
+        image_add(w.img);
+        fprintf(stderr, "%s: '%s' is ready (%zu bytes) after %llu ms\n", appname,
+                artifacts[w.i].name, w.img->size,
+                (unsigned long long)((now() - w.begun) / 1000));
+    }
+    if (warm.count) {
+        return;
+    }
+    solicit_start();
+    for (int i = 0; i < known_count; i++) {
+        if (knowns[i].waiting && (session_find(&knowns[i].t.addr) == NULL)) {
+            session_start(&knowns[i].t);
+        }
+    }
+}
 
-    msg->cmd = NB_SEND_FILE;
-    msg->arg = 0;
-    strcpy((void*)msg->data, "kernel.bin");
-    if (io(s, msg, sizeof(nbmsg) + sizeof("kernel.bin"), ack)) {
-        fprintf(stderr, "%s: failed to start transfer\n", appname);
-        goto done;
+// Watch the directory of each file sent, so that one replaced by a
+// rename is seen as well as one written in place
+static int watch_start(void) {
+    char dir[PATH_MAX];
+    int in;
+
+    if ((in = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "%s: cannot watch files %d\n", appname, errno);
+        return -1;
     }
+    for (int i = 0; i < artifact_count; i++) {
+        artifact* a = artifacts + i;
+        const char* slash;
 
-    msg->cmd = NB_DATA;
-    msg->arg = 0;
-    do {
-        r = fread(msg->data, 1, 1024, fp);
-        if (r == 0) {
-            if (ferror(fp)) {
-                fprintf(stderr, "\n%s: error: reading '%s'\n", appname, fn);
-                goto done;
+        if (a->path == NULL) {
+            continue;
+        }
+        if ((slash = strrchr(a->path, '/')) == NULL) {
+            strcpy(dir, ".");
+            a->file = a->path;
+        } else if (snprintf(dir, sizeof(dir), "%.*s", (int)(slash - a->path + 1),
+                            a->path) >= sizeof(dir)) {
+            fprintf(stderr, "%s: path too long '%s'\n", appname, a->path);
+            return -1;
+        } else {
+            a->file = slash + 1;
+        }
+        if ((a->wd = inotify_add_watch(in, dir, IN_CLOSE_WRITE | IN_MOVED_TO)) < 0) {
+            fprintf(stderr, "%s: cannot watch '%s' %d\n", appname, dir, errno);
+            return -1;
+        }
+    }
+    return in;
+}
+
+static void watch_read(int in) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event* ev;
+    ssize_t r;
+
+    while ((r = read(in, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < (buf + r); p += sizeof(*ev) + ev->len) {
+            ev = (void*)p;
+            if (ev->len == 0) {
+                continue;
             }
-            break;
+            for (int i = 0; i < artifact_count; i++) {
+                artifact* a = artifacts + i;
+                if (a->path && (a->wd == ev->wd) && !strcmp(a->file, ev->name)) {
+                    fprintf(stderr, "%s: '%s' has changed\n", appname, a->path);
+                    warm_change(i);
+                }
+            }
+        }
+    }
+}
+
+// Start a session for a bootloader that beacons while it has none
+static void beacon(int s) {
+    struct sockaddr_in6 ra;
+    socklen_t rlen;
+    char tmp[INET6_ADDRSTRLEN];
+    char buf[4096];
+    nbmsg* msg = (void*)buf;
+    const char* val;
+    target t;
+    int n, r;
+
+    rlen = sizeof(ra);
+    r = recvfrom(s, buf, 4096, MSG_DONTWAIT, (void*)&ra, &rlen);
+    if (r < 0) {
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            fprintf(stderr, "%s: socket read error %d\n", appname, errno);
+        }
+        return;
+    }
+    if (r < sizeof(nbmsg))
+        return;
+    if ((ra.sin6_addr.s6_addr[0] != 0xFE) || (ra.sin6_addr.s6_addr[1] != 0x80)) {
+        fprintf(stderr, "ignoring non-link-local message\n");
+        return;
+    }
+    if (msg->magic != NB_MAGIC)
+        return;
+    if (msg->cmd != NB_ADVERTISE)
+        return;
+    // a target with several ports is known by the first it lists, and
+    // is only started by the beacon from that one
+    t.addr = ra;
+    t.nics[0] = ra;
+    t.nnics = 1;
+    if ((val = adv_get(msg, r, "nics")) != NULL) {
+        nics_get(&t, val);
+        if ((t.nnics == 0) || memcmp(&t.nics[0].sin6_addr, &ra.sin6_addr, sizeof(ra.sin6_addr))) {
+            nic_heard(&ra);
+            return;
+        }
+    }
+    if (session_find(&ra) != NULL)
+        return;
+    fprintf(stderr, "%s: got beacon from [%s]%d\n", appname,
+            inet_ntop(AF_INET6, &ra.sin6_addr, tmp, sizeof(tmp)),
+            ntohs(ra.sin6_port));
+    // only peers that advertise a window understand windowed mode
+    val = adv_get(msg, r, "window");
+    t.window = val ? strtoul(val, NULL, 10) : 0;
+    if (t.window > window) {
+        t.window = window;
+    }
+    // a window of one block is run in lockstep, and asked for as such
+    if (t.window < 2) {
+        t.window = 0;
+    }
+    val = adv_get(msg, r, "blocksize");
+    t.blksz = val ? strtoul(val, NULL, 10) : NB_DEFAULT_BLOCKSIZE;
+    if (t.blksz > blksz) {
+        t.blksz = blksz;
+    }
+    // and only one lockstep transfer can run at a time
+    val = adv_get(msg, r, "files");
+    t.files = val ? strtoul(val, NULL, 10) : 1;
+    if ((t.files < 1) || (t.window < 2)) {
+        t.files = 1;
+    }
+    // compressed files only go in windowed transfers
+    val = adv_get(msg, r, "compress");
+    t.lz4 = compress && (t.window >= 2) && val && !strcmp(val, "lz4");
+    val = adv_get(msg, r, "verify");
+    t.crc = val && !strcmp(val, "crc32c");
+    t.stats = adv_get(msg, r, "stats") != NULL;
+    t.resume = adv_get(msg, r, "resume") != NULL;
+    t.sized = adv_get(msg, r, "size") != NULL;
+    val = adv_get(msg, r, "offsets");
+    t.wide = val && !strcmp(val, "64");
+    // parity only goes with windowed files of a size the target knows
+    val = adv_get(msg, r, "fec");
+    t.fec = (fec || fec_auto) && (t.window >= 2) && t.sized && val && !strcmp(val, "xor");
+    if ((t.set = set_find(msg, r))->count == 0) {
+        const char* serialno = adv_get(msg, r, "serialno");
+        const char* board = adv_get(msg, r, "board");
+        fprintf(stderr, "%s: no files for [%s] (serialno %s, board %s)\n", appname,
+                inet_ntop(AF_INET6, &ra.sin6_addr, tmp, sizeof(tmp)),
+                serialno ? serialno : "unknown", board ? board : "unknown");
+        return;
+    }
+    // a group is pushed the default files, and only those
+    if (group_size && (t.set == sets)) {
+        for (n = 0; n < group_count; n++) {
+            if (!memcmp(&group_list[n].addr.sin6_addr, &ra.sin6_addr, sizeof(ra.sin6_addr)))
+                break;
         }
-        count += r;
-        if (count >= (32 * 1024)) {
-            count = 0;
-            fprintf(stderr, "#");
+        if (n == group_count) {
+            group_list[n] = t;
+            group_count++;
         }
-        if (io(s, msg, sizeof(nbmsg) + r, ack)) {
-            fprintf(stderr, "\n%s: error: sending '%s'\n", appname, fn);
-            goto done;
+        if (group_count < group_size) {
+            return;
         }
-        msg->arg += r;
-    } while (r != 0);
+        push_group(group_list, group_count);
+        group_count = 0;
+    } else {
+        session_start(&t);
+    }
+}
 
-    msg->cmd = NB_BOOT;
-    msg->arg = 0;
-    if (io(s, msg, sizeof(nbmsg), ack)) {
-        fprintf(stderr, "\n%s: failed to send boot command\n", appname);
+// Add a file to a set, as <name>=<path> or under the name its position
+// implies
+static int add_artifact(imageset* set, const char* arg) {
+    static const char* names[] = { "kernel.bin", "ramdisk.bin" };
+    artifact* a = artifacts + artifact_count;
+    const char* eq = strchr(arg, '=');
+
+    if ((set->count == MAXFILES) || (artifact_count == MAXARTIFACTS))
+        return -1;
+    if (eq) {
+        if ((eq == arg) || ((eq - arg) > 128))
+            return -1;
+        a->name = strndup(arg, eq - arg);
+        a->path = eq + 1;
     } else {
-        fprintf(stderr, "\n%s: sent boot command\n", appname);
+        if (set->unnamed == (sizeof(names) / sizeof(names[0])))
+            return -1;
+        a->name = names[set->unnamed++];
+        a->path = arg;
     }
-done:
-    if (s >= 0)
-        close(s);
-    if (fp != NULL)
-        fclose(fp);
+    artifact_count++;
+    set->count++;
+    return 0;
 }
 
-void usage(void) {
-    fprintf(stderr,
-            "usage:   %s [ <option> ]* <filename>\n"
-            "\n"
-            "options: -1  only boot once, then exit\n",
-            appname);
-    exit(1);
+// Have a set send the rest of the arguments, joined by spaces, as the
+// cmdline
+static int add_cmdline(imageset* set, int argc, char** argv) {
+    artifact* a = artifacts + artifact_count;
+    image* img;
+    size_t len = 0;
+
+    if ((argc == 0) || (set->count == MAXFILES) || (artifact_count == MAXARTIFACTS))
+        return -1;
+    for (int i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    if ((img = calloc(1, sizeof(image))) == NULL)
+        return -1;
+    if ((img->data = malloc(len)) == NULL)
+        return -1;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0) {
+            img->data[img->size++] = ' ';
+        }
+        memcpy(img->data + img->size, argv[i], strlen(argv[i]));
+        img->size += strlen(argv[i]);
+    }
+    img->refs = 1;
+    a->name = "cmdline";
+    a->img = img;
+    artifact_count++;
+    set->count++;
+    return 0;
 }
 
-void drain(int fd) {
-    char buf[4096];
-    if (fcntl(fd, F_SETFL, O_NONBLOCK) == 0) {
-        while (read(fd, buf, sizeof(buf)) > 0)
-            ;
-        fcntl(fd, F_SETFL, 0);
+// Read a registry. Each line, but blank ones and those starting with #,
+// is <key>=<value> and then the files of a set, given as they are on
+// the command line.
+static int load_registry(const char* path) {
+    char line[4096];
+    char* argv[128];
+    FILE* fp;
+    int n = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, path);
+        return -1;
     }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        imageset* set = sets + set_count;
+        char* copy;
+        char* save;
+        char* eq;
+        int argc = 0;
+
+        n++;
+        if ((copy = strdup(line)) == NULL) {
+            goto fail;
+        }
+        for (char* tok = strtok_r(copy, " \t\r\n", &save);
+             (tok != NULL) && (argc < (sizeof(argv) / sizeof(argv[0])));
+             tok = strtok_r(NULL, " \t\r\n", &save)) {
+            argv[argc++] = tok;
+        }
+        if ((argc == 0) || (argv[0][0] == '#')) {
+            free(copy);
+            continue;
+        }
+        // (the strings stay put, as the set points into them)
+        if ((set_count == MAXSETS) || (argc < 2) ||
+            ((eq = strchr(argv[0], '=')) == NULL) || (eq == argv[0])) {
+            goto fail;
+        }
+        *eq = 0;
+        set->key = argv[0];
+        set->value = eq + 1;
+        set->first = artifact_count;
+        for (int i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], "--")) {
+                if (add_cmdline(set, argc - i - 1, argv + i + 1)) {
+                    goto fail;
+                }
+                break;
+            }
+            if ((argv[i][0] == '-') || add_artifact(set, argv[i])) {
+                goto fail;
+            }
+        }
+        set_count++;
+    }
+    fclose(fp);
+    return 0;
+
+fail:
+    fprintf(stderr, "%s: %s:%d: bad entry\n", appname, path, n);
+    fclose(fp);
+    return -1;
 }
 
 int main(int argc, char** argv) {
     struct sockaddr_in6 addr;
+    struct epoll_event ev[4];
     char tmp[INET6_ADDRSTRLEN];
-    int r, s, n = 1;
-    const char* fn = NULL;
+    pthread_t worker;
+    int r, s, ep, in = -1, n = 1;
+    const char* registry = NULL;
+    int finished = 0;
     int once = 0;
 
     appname = argv[0];
 
+    // a bootloader takes an NB_SEND_FILE with the cookie of the last one
+    // for a resend, so don't start where an earlier run did
+    cookie = ((uint32_t)time(NULL) << 8) ^ (uint32_t)getpid();
+
     while (argc > 1) {
-        if (argv[1][0] != '-') {
-            if (fn != NULL)
+        if (!strcmp(argv[1], "--")) {
+            if (add_cmdline(sets, argc - 2, argv + 2))
+                usage();
+            break;
+        } else if (argv[1][0] != '-') {
+            if (add_artifact(sets, argv[1]))
                 usage();
-            fn = argv[1];
         } else if (!strcmp(argv[1], "-1")) {
             once = 1;
+        } else if (!strcmp(argv[1], "-z")) {
+            compress = 1;
+        } else if (!strcmp(argv[1], "-j")) {
+            json = 1;
+        } else if (!strcmp(argv[1], "-W")) {
+            watch = 1;
+        } else if (!strcmp(argv[1], "-r")) {
+            if (argc < 3)
+                usage();
+            registry = argv[2];
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-w")) {
+            if (argc < 3)
+                usage();
+            window = strtoul(argv[2], NULL, 0) & NB_WINDOW_MASK;
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-b")) {
+            if (argc < 3)
+                usage();
+            blksz = strtoul(argv[2], NULL, 0);
+            if ((blksz == 0) || (blksz > (MAXPACKET - sizeof(nbmsg))))
+                usage();
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-f")) {
+            if (argc < 3)
+                usage();
+            if (!strcmp(argv[2], "auto")) {
+                fec_auto = 1;
+            } else {
+                fec = strtoul(argv[2], NULL, 0);
+                if ((fec < 2) || (fec > NB_MAX_FEC))
+                    usage();
+            }
+            argc--;
+            argv++;
+        } else if (!strcmp(argv[1], "-m")) {
+            if (argc < 3)
+                usage();
+            group_size = strtoul(argv[2], NULL, 0);
+            if ((group_size < 1) ||
+                ((group_list = calloc(group_size, sizeof(target))) == NULL))
+                usage();
+            argc--;
+            argv++;
         } else {
             usage();
         }
         argc--;
         argv++;
     }
-    if (fn == NULL) {
+    if (registry && load_registry(registry)) {
+        return -1;
+    }
+    if (artifact_count == 0) {
         usage();
     }
 
@@ -209,39 +2959,104 @@ int main(int argc, char** argv) {
         return -1;
     }
 
+    // many sessions' windows may be in flight at once
+    if ((xs = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        fprintf(stderr, "%s: cannot create socket %d\n", appname, errno);
+        return -1;
+    }
+    n = 4 * 1024 * 1024;
+    setsockopt(xs, SOL_SOCKET, SO_SNDBUF, &n, sizeof(n));
+    setsockopt(xs, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+    n = 0;
+    setsockopt(xs, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &n, sizeof(n));
+
+    if ((ep = epoll_create1(0)) < 0) {
+        fprintf(stderr, "%s: cannot create epoll %d\n", appname, errno);
+        return -1;
+    }
+    ev[0].events = EPOLLIN;
+    ev[0].data.fd = s;
+    epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev[0]);
+    ev[0].events = EPOLLIN;
+    ev[0].data.fd = xs;
+    epoll_ctl(ep, EPOLL_CTL_ADD, xs, &ev[0]);
+
+    if (watch) {
+        // (the CRC and chunking tables are made on first use, which is
+        // best not left to two threads at once)
+        static const uint8_t zero[CDC_MIN + 1];
+        crc32c(0, zero, sizeof(zero));
+        cdc_next(zero, sizeof(zero));
+
+        if ((in = watch_start()) < 0) {
+            return -1;
+        }
+        if (pipe2(warm.fd, O_CLOEXEC) < 0) {
+            fprintf(stderr, "%s: cannot create pipe %d\n", appname, errno);
+            return -1;
+        }
+        if ((r = pthread_create(&worker, NULL, warm_worker, NULL)) != 0) {
+            fprintf(stderr, "%s: cannot start thread %d\n", appname, r);
+            return -1;
+        }
+        ev[0].events = EPOLLIN;
+        ev[0].data.fd = in;
+        epoll_ctl(ep, EPOLL_CTL_ADD, in, &ev[0]);
+        ev[0].events = EPOLLIN;
+        ev[0].data.fd = warm.fd[0];
+        epoll_ctl(ep, EPOLL_CTL_ADD, warm.fd[0], &ev[0]);
+        // and have every file ready before the first beacon
+        for (n = 0; n < artifact_count; n++) {
+            if (artifacts[n].path) {
+                warm_change(n);
+            }
+        }
+    }
+
     fprintf(stderr, "%s: listening on [%s]%d\n", appname,
             inet_ntop(AF_INET6, &addr.sin6_addr, tmp, sizeof(tmp)),
             ntohs(addr.sin6_port));
+    solicit_start();
     for (;;) {
-        struct sockaddr_in6 ra;
-        socklen_t rlen;
-        char buf[4096];
-        nbmsg* msg = (void*)buf;
-        rlen = sizeof(ra);
-        r = recvfrom(s, buf, 4096, 0, (void*)&ra, &rlen);
-        if (r < 0) {
-            fprintf(stderr, "%s: socket read error %d\n", appname, r);
+        int timeout = session_poll();
+        finished += session_reap();
+        if (once && finished && (sessions == NULL)) {
             break;
         }
-        if (r < sizeof(nbmsg))
-            continue;
-        if ((ra.sin6_addr.s6_addr[0] != 0xFE) || (ra.sin6_addr.s6_addr[1] != 0x80)) {
-            fprintf(stderr, "ignoring non-link-local message\n");
-            continue;
+        if (!(once && finished)) {
+            int next = solicit(s);
+            if ((next >= 0) && ((timeout < 0) || (next < timeout))) {
+                timeout = next;
+            }
         }
-        if (msg->magic != NB_MAGIC)
-            continue;
-        if (msg->cmd != NB_ADVERTISE)
-            continue;
-        fprintf(stderr, "%s: got beacon from [%s]%d\n", appname,
-                inet_ntop(AF_INET6, &ra.sin6_addr, tmp, sizeof(tmp)),
-                ntohs(ra.sin6_port));
-        fprintf(stderr, "%s: sending '%s'...\n", appname, fn);
-        xfer(&ra, fn);
-        if (once) {
+        r = epoll_wait(ep, ev, 4, timeout);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: epoll error %d\n", appname, errno);
             break;
         }
-        drain(s);
+        for (n = 0; n < r; n++) {
+            if (ev[n].data.fd == in) {
+                watch_read(in);
+                continue;
+            }
+            if (watch && (ev[n].data.fd == warm.fd[0])) {
+                warm_done();
+                continue;
+            }
+            if (ev[n].data.fd != s) {
+                continue;
+            }
+            // after the first boot, -1 only finishes what was started
+            if (once && finished) {
+                recv(s, tmp, sizeof(tmp), MSG_DONTWAIT);
+            } else {
+                beacon(s);
+            }
+        }
+        txq_flush();
     }
 
     return 0;
@@ -3,11 +3,16 @@
 // found in the LICENSE file.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <cdc.h>
+#include <crc32c.h>
 #include <inet6.h>
+#include <lz4.h>
 #include <netboot.h>
 #include <netifc.h>
+#include <tftp.h>
 
 static uint32_t last_cookie = 0;
 static uint32_t last_cmd = 0;
@@ -18,15 +23,696 @@ static uint32_t last_ack_arg = 0;
 static int nb_boot_now = 0;
 static int nb_active = 0;
 
-// item being downloaded
-static nbfile* item;
+static void advertise(const ip6_addr* daddr, uint16_t dport);
+
+// what item_write() returns for a block that failed its checksum, to be
+// dropped without an ack (NB_ACK is 0, and errors have the top bit set)
+#define ITEM_DROP 1
+
+// A file being received. Windowed data is matched to its file by the
+// cookie of the NB_SEND_FILE that started it.
+#define MAX_RANGES 512
+typedef struct {
+    nbfile* item;
+    uint32_t cookie;
+    uint32_t window; // granted window (0 = lockstep)
+    int leader;      // whether group data is acked (see NB_FILE_LEADER)
+    uint32_t age;    // when it was started, to pick a slot to reuse
+
+    // whether only the chunks missing from the cached copy are sent
+    int delta;
+
+    // whether offsets are sent in 64 bits (see NB_FILE_WIDE)
+    int wide;
+
+    // the length of the file, if the host said (see "size")
+    uint64_t size;
+
+    // blocks to a parity group, if lost ones can be rebuilt (see
+    // NB_FILE_FEC)
+    uint32_t fec;
+
+    // bytes received in order (of the compressed form, or of the stream
+    // of missing chunks, if the file is not sent as is)
+    uint64_t offset;
+
+    // data held past offset, sorted and never touching each other
+    nbrange64 ranges[MAX_RANGES];
+    unsigned range_count;
+
+    // for a compressed file: where it is staged, the offset of the first
+    // chunk not yet decoded, and the error to report once decoding fails
+    uint8_t* ring;
+    uint64_t cpos;
+    uint32_t error;
+
+    // whether it picked up where an earlier transfer left off
+    int resumed;
+
+    // the CRC-32C the file should have (if check is set), and that of
+    // the first crcpos bytes of it
+    int check;
+    uint32_t want;
+    uint32_t crc;
+    uint64_t crcpos;
+
+    // what NB_STATS reports: the name it was sent as (cut short if need
+    // be), and the NB_DATA packets and bytes received, the duplicates
+    // among them, those dropped for lack of room, and the blocks rebuilt
+    // from parity
+    char name[64];
+    uint32_t packets;
+    uint64_t bytes;
+    uint32_t dups;
+    uint32_t dropped;
+    uint32_t recovered;
+} xfer;
+
+// Compressed data is staged in a ring at the end of the file's buffer
+// until whole chunks can be decoded into its start.  The first
+// LZ4_HDR_LEN + LZ4_CHUNK bytes of the ring are mirrored past its end, so
+// that every chunk can be decoded in one piece.
+#define RING_SIZE (256 * 1024)
+#define RING_SPAN (RING_SIZE + LZ4_HDR_LEN + LZ4_CHUNK)
+
+static size_t blocksize(void);
+
+static xfer xfers[NB_MAX_FILES];
+static uint32_t xfer_age = 0;
+
+// the file lockstep data goes to, if any
+static xfer* lockstep = 0;
+
+static xfer* xfer_find(uint32_t cookie) {
+    for (int i = 0; i < NB_MAX_FILES; i++) {
+        if (xfers[i].item && xfers[i].window && (xfers[i].cookie == cookie)) {
+            return xfers + i;
+        }
+    }
+    return 0;
+}
+
+// Find the slot that last received the file called name
+static xfer* xfer_named(const char* name) {
+    size_t n = strlen(name) + 1;
+
+    for (int i = 0; i < NB_MAX_FILES; i++) {
+        if (xfers[i].item && (n <= sizeof(xfers[i].name)) &&
+            !memcmp(xfers[i].name, name, n)) {
+            return xfers + i;
+        }
+    }
+    return 0;
+}
+
+// Pick the slot to receive item in: the one it already has, else a free
+// one, else the one started longest ago
+static xfer* xfer_slot(nbfile* item) {
+    xfer* x = xfers;
+    for (int i = 0; i < NB_MAX_FILES; i++) {
+        if (xfers[i].item == item) {
+            return xfers + i;
+        }
+        if ((x->item != 0) && ((xfers[i].item == 0) || (xfers[i].age < x->age))) {
+            x = xfers + i;
+        }
+    }
+    return x;
+}
+
+static void range_remove(xfer* x, unsigned i) {
+    x->range_count--;
+    memmove(x->ranges + i, x->ranges + i + 1,
+            (x->range_count - i) * sizeof(nbrange64));
+}
+
+// Record that [start, end) of a file has arrived. Returns -1 if there is
+// no room to track another hole, in which case the data must be dropped.
+static int range_add(xfer* x, uint64_t start, uint64_t end) {
+    unsigned i = x->range_count;
+
+    // data mostly arrives in order, so search from the top
+    while ((i > 0) && (x->ranges[i - 1].start > start)) {
+        i--;
+    }
+    if ((i > 0) && (x->ranges[i - 1].end >= start)) {
+        i--;
+        if (x->ranges[i].end < end) {
+            x->ranges[i].end = end;
+        }
+    } else {
+        if (x->range_count == MAX_RANGES) {
+            return -1;
+        }
+        memmove(x->ranges + i + 1, x->ranges + i,
+                (x->range_count - i) * sizeof(nbrange64));
+        x->ranges[i].start = start;
+        x->ranges[i].end = end;
+        x->range_count++;
+    }
+    // swallow any ranges the new data bridged to
+    while (((i + 1) < x->range_count) && (x->ranges[i + 1].start <= x->ranges[i].end)) {
+        if (x->ranges[i].end < x->ranges[i + 1].end) {
+            x->ranges[i].end = x->ranges[i + 1].end;
+        }
+        range_remove(x, i + 1);
+    }
+    return 0;
+}
+
+// Fold whatever has been received in order since last time into the
+// file's CRC, while it is still in the cache
+static void xfer_digest(xfer* x) {
+    nbfile* item = x->item;
+
+    if (x->check && (x->crcpos < item->offset)) {
+        x->crc = crc32c(x->crc, item->data + x->crcpos, item->offset - x->crcpos);
+        x->crcpos = item->offset;
+    }
+}
+
+// Files that came with a CRC they did not match when their slots were
+// taken for other files, until they are sent again (should there be more
+// than fit, booting is refused from then on)
+static const nbfile* corrupt[NB_MAX_FILES];
+static unsigned corrupt_count = 0;
+static int corrupt_lost = 0;
+
+// Check a file that is to lose its slot, which xfers_verify() would not
+// get to see
+static void xfer_evict(xfer* x) {
+    if ((x->item == 0) || !x->check) {
+        return;
+    }
+    xfer_digest(x);
+    if (x->crc == x->want) {
+        return;
+    }
+    printf("netboot: file '%s' is corrupt (crc %08x, expected %08x)\n",
+           x->name, x->crc, x->want);
+    for (unsigned i = 0; i < corrupt_count; i++) {
+        if (corrupt[i] == x->item) {
+            return;
+        }
+    }
+    if (corrupt_count < NB_MAX_FILES) {
+        corrupt[corrupt_count++] = x->item;
+    } else {
+        corrupt_lost = 1;
+    }
+}
+
+// Forget the verdict on a file that is being sent again
+static void corrupt_forget(const nbfile* item) {
+    for (unsigned i = 0; i < corrupt_count; i++) {
+        if (corrupt[i] == item) {
+            corrupt[i] = corrupt[--corrupt_count];
+            return;
+        }
+    }
+}
+
+// Check every file that came with a CRC, including those that lost their
+// slots. A delta's data does not arrive in order, so all of it is checked
+// here.
+static int xfers_verify(void) {
+    int r = (corrupt_count || corrupt_lost) ? -1 : 0;
+
+    for (int i = 0; i < NB_MAX_FILES; i++) {
+        xfer* x = xfers + i;
+        if ((x->item == 0) || !x->check) {
+            continue;
+        }
+        xfer_digest(x);
+        if (x->crc != x->want) {
+            printf("netboot: file %d is corrupt (crc %08x, expected %08x)\n",
+                   i, x->crc, x->want);
+            r = -1;
+        }
+    }
+    return r;
+}
+
+uint32_t netboot_file_done(const nbfile* item) {
+    for (int i = 0; i < NB_MAX_FILES; i++) {
+        xfer* x = xfers + i;
+        if (x->item != item) {
+            continue;
+        }
+        // a delta's chunks do not arrive in order, so there is no
+        // telling it is done until the host says so
+        if (x->size && !x->delta && !x->error && (item->offset == x->size)) {
+            return x->age;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+uint32_t netboot_tftp_start(nbfile* item, const char* name) {
+    xfer* x = xfer_slot(item);
+    size_t n;
+
+    if (x->item != item) {
+        xfer_evict(x);
+    }
+    corrupt_forget(item);
+    if (lockstep == x) {
+        lockstep = 0;
+    }
+    // (with no window and no size, no nbmsg data matches it, nor is it
+    // done until netboot_tftp_done())
+    memset(x, 0, sizeof(*x));
+    x->item = item;
+    x->age = ++xfer_age;
+    if ((n = strlen(name)) >= sizeof(x->name)) {
+        n = sizeof(x->name) - 1;
+    }
+    memcpy(x->name, name, n);
+    x->name[n] = 0;
+    return x->age;
+}
+
+static xfer* xfer_tftp(const nbfile* item, uint32_t id) {
+    for (int i = 0; i < NB_MAX_FILES; i++) {
+        if ((xfers[i].item == item) && (xfers[i].age == id)) {
+            return xfers + i;
+        }
+    }
+    return 0;
+}
+
+int netboot_tftp_held(const nbfile* item, uint32_t id) {
+    return xfer_tftp(item, id) != 0;
+}
+
+void netboot_tftp_done(const nbfile* item, uint32_t id) {
+    xfer* x;
+
+    if ((x = xfer_tftp(item, id)) != 0) {
+        x->size = item->offset;
+        x->offset = item->offset;
+    }
+}
+
+// Find the value of key in a "key\0value\0" list, which ends in a
+// terminator
+static const char* kv_get(const char* p, const char* end, const char* key) {
+    size_t n = strlen(key);
+
+    while (p < end) {
+        const char* val = p + strlen(p) + 1;
+        if (val >= end) {
+            break;
+        }
+        if ((strlen(p) == n) && !memcmp(p, key, n)) {
+            return val;
+        }
+        p = val + strlen(val) + 1;
+    }
+    return 0;
+}
+
+static void ring_write(xfer* x, uint64_t off, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        uint32_t pos = off % RING_SIZE;
+        size_t n = RING_SIZE - pos;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(x->ring + pos, data, n);
+        if (pos < (RING_SPAN - RING_SIZE)) {
+            size_t m = RING_SPAN - RING_SIZE - pos;
+            memcpy(x->ring + RING_SIZE + pos, data, (m < n) ? m : n);
+        }
+        off += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// Decode every chunk of a compressed file that has arrived in full
+static uint32_t ring_decode(xfer* x) {
+    nbfile* item = x->item;
+    size_t limit = item->size - RING_SPAN;
+
+    while ((x->offset - x->cpos) >= LZ4_HDR_LEN) {
+        uint8_t* p = x->ring + (x->cpos % RING_SIZE);
+        uint32_t hdr = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        uint32_t len = hdr & ~LZ4_STORED;
+        int n;
+
+        if (len > LZ4_CHUNK) {
+            return NB_ERROR_BAD_PARAM;
+        }
+        if ((x->offset - x->cpos - LZ4_HDR_LEN) < len) {
+            break;
+        }
+        p += LZ4_HDR_LEN;
+        if (hdr & LZ4_STORED) {
+            if (len > (limit - item->offset)) {
+                return NB_ERROR_TOO_LARGE;
+            }
+            memcpy(item->data + item->offset, p, len);
+            n = len;
+        } else {
+            n = lz4_decode(p, len, item->data + item->offset, limit - item->offset, item->data);
+            if (n < 0) {
+                return NB_ERROR_BAD_PARAM;
+            }
+        }
+        item->offset += n;
+        x->cpos += LZ4_HDR_LEN + len;
+    }
+    return 0;
+}
+
+// Whether none of start to end is held
+static int xfer_lacks(xfer* x, uint64_t start, uint64_t end) {
+    if (start < x->offset) {
+        return 0;
+    }
+    for (unsigned i = 0; i < x->range_count; i++) {
+        if ((x->ranges[i].start < end) && (start < x->ranges[i].end)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Store a windowed block wherever it belongs, advance over anything that
+// is now contiguous, and decompress what can be.  Returns the error to
+// ack with, if any, or ITEM_DROP if the block failed its checksum.
+//
+// A block going straight into the file, all of it to bytes not held yet,
+// is checked as it is copied there: should it be bad, nothing held was
+// touched, and what it covers is only recorded as held once it is good.
+// Any other is checked before anything is done with it.
+static uint32_t item_write(xfer* x, uint32_t arg, uint8_t* data, size_t len) {
+    nbfile* item = x->item;
+    uint64_t off = arg;
+    uint64_t pos;
+    uint64_t end;
+    uint32_t word = 0;
+    size_t skip = (x->wide || x->delta) ? sizeof(uint32_t) : 0;
+    int fused;
+
+    // a wide block carries the high half of its offset, and a delta
+    // block says where in the file it goes
+    if (len >= skip) {
+        memcpy(&word, data, skip);
+        if (x->wide) {
+            off |= (uint64_t)word << 32;
+        }
+    }
+    pos = x->delta ? word : off;
+    end = off + len - skip;
+    fused = !x->ring && !x->delta && (len > skip) && (end <= item->size) &&
+            xfer_lacks(x, off, end);
+    if (fused ? udp6_check_copy(item->data + pos, data + skip, len - skip) : udp6_check()) {
+        return ITEM_DROP;
+    }
+
+    x->packets++;
+    x->bytes += len;
+    if (skip) {
+        if (len < skip) {
+            return NB_ERROR_BAD_PARAM;
+        }
+        data += skip;
+        len -= skip;
+    }
+    if (!x->ring && ((len > item->size) || (pos > (item->size - len)))) {
+        return NB_ERROR_TOO_LARGE;
+    }
+    if (end <= x->offset) {
+        // duplicate
+        x->dups++;
+        return x->error;
+    }
+    if (off < x->offset) {
+        data += x->offset - off;
+        pos += x->offset - off;
+        off = x->offset;
+        len = end - off;
+    }
+    if (x->ring && ((end - x->cpos) > RING_SIZE)) {
+        // no room for it until earlier chunks are decoded
+        x->dropped++;
+        return x->error;
+    }
+    if (off > x->offset) {
+        if (range_add(x, off, end)) {
+            x->dropped++;
+            return x->error;
+        }
+    } else {
+        x->offset = end;
+    }
+    if (x->ring) {
+        ring_write(x, off, data, len);
+    } else if (!fused) {
+        memcpy(item->data + pos, data, len);
+    }
+    while ((x->range_count > 0) && (x->ranges[0].start <= x->offset)) {
+        if (x->offset < x->ranges[0].end) {
+            x->offset = x->ranges[0].end;
+        }
+        range_remove(x, 0);
+    }
+    if (x->ring) {
+        if (!x->error) {
+            x->error = ring_decode(x);
+        }
+    } else if (!x->delta) {
+        // (a delta's length is known from its chunks)
+        item->offset = x->offset;
+    }
+    if (!x->delta) {
+        xfer_digest(x);
+    }
+    return x->error;
+}
+
+// Whether all of start to end is held
+static int xfer_holds(xfer* x, uint64_t start, uint64_t end) {
+    if (end <= x->offset) {
+        return 1;
+    }
+    for (unsigned i = 0; i < x->range_count; i++) {
+        if ((x->ranges[i].start <= start) && (end <= x->ranges[i].end)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Rebuild the block missing from the group of blocks NB_PARITY covers,
+// if only one is: the parity of the group, with the others XORed out of
+// it, is that block. Returns the error to ack with, if any.
+static uint32_t parity_recv(xfer* x, uint32_t arg, uint8_t* data, size_t len) {
+    uint64_t off = arg;
+    uint64_t lost = 0;
+    uint64_t pos;
+    uint32_t word;
+    uint32_t err;
+    unsigned missing = 0;
+    size_t n;
+
+    if (x->wide) {
+        if (len < sizeof(uint32_t)) {
+            return NB_ERROR_BAD_PARAM;
+        }
+        memcpy(&word, data, sizeof(uint32_t));
+        off |= (uint64_t)word << 32;
+        data += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+    }
+    if ((len == 0) || (off >= x->size)) {
+        return NB_ERROR_BAD_PARAM;
+    }
+    for (pos = off; (pos < x->size) && (pos < (off + x->fec * len)); pos += len) {
+        n = ((x->size - pos) < len) ? (x->size - pos) : len;
+        if (!xfer_holds(x, pos, pos + n) && (missing++ == 0)) {
+            lost = pos;
+        }
+    }
+    if (missing != 1) {
+        // nothing to do, or too much
+        return x->error;
+    }
+    for (pos = off; (pos < x->size) && (pos < (off + x->fec * len)); pos += len) {
+        n = ((x->size - pos) < len) ? (x->size - pos) : len;
+        if (pos != lost) {
+            const uint8_t* p = x->item->data + pos;
+            for (size_t i = 0; i < n; i++) {
+                data[i] ^= p[i];
+            }
+        }
+    }
+    n = ((x->size - lost) < len) ? (x->size - lost) : len;
+    if (x->wide) {
+        // it goes in as a block of its own, high half of offset first
+        word = lost >> 32;
+        data -= sizeof(uint32_t);
+        memcpy(data, &word, sizeof(uint32_t));
+        n += sizeof(uint32_t);
+    }
+    // (it is not counted as a packet received)
+    err = item_write(x, lost, data, n);
+    x->packets--;
+    x->bytes -= n;
+    x->recovered++;
+    return err;
+}
+
+size_t netboot_cache_slots(size_t len) {
+    // keep the index at most half full
+    return 2 * (len / CDC_MIN + 1);
+}
+
+void netboot_cache(nbfile* item, const void* data, size_t len, nbchunk* index) {
+    const uint8_t* p = data;
+    size_t slots = netboot_cache_slots(len);
+    size_t n;
+
+    memset(index, 0, slots * sizeof(nbchunk));
+    for (size_t off = 0; off < len; off += n) {
+        n = cdc_next(p + off, len - off);
+        uint64_t hash = cdc_hash(p + off, n);
+        nbchunk* c = index + (hash % slots);
+        while ((c->len != 0) && (c->hash != hash)) {
+            if (++c == (index + slots)) {
+                c = index;
+            }
+        }
+        c->hash = hash;
+        c->offset = off;
+        c->len = n;
+    }
+    item->cache = data;
+    item->index = index;
+    item->slots = slots;
+}
+
+static const nbchunk* cache_find(nbfile* item, const nbchunk* chunk) {
+    const nbchunk* c = item->index + (chunk->hash % item->slots);
+
+    while (c->len != 0) {
+        if (c->hash == chunk->hash) {
+            return (c->len == chunk->len) ? c : 0;
+        }
+        if (++c == (item->index + item->slots)) {
+            c = item->index;
+        }
+    }
+    return 0;
+}
+
+// Copy the chunks of a delta transfer that the cache holds into place,
+// and mark them in the bitmap at have. Returns the error to ack with,
+// if any.
+static uint32_t chunks_recv(xfer* x, const nbchunk* chunk, size_t count, uint8_t* have) {
+    nbfile* item = x->item;
+
+    memset(have, 0, NB_MAX_CHUNKS / 8);
+    for (size_t i = 0; i < count; i++, chunk++) {
+        if ((chunk->len > item->size) || (chunk->offset > (item->size - chunk->len))) {
+            return NB_ERROR_TOO_LARGE;
+        }
+        if (item->offset < (chunk->offset + chunk->len)) {
+            item->offset = chunk->offset + chunk->len;
+        }
+        const nbchunk* c = cache_find(item, chunk);
+        if (c) {
+            memcpy(item->data + chunk->offset, item->cache + c->offset, chunk->len);
+            have[i / 8] |= 1 << (i % 8);
+        }
+    }
+    return 0;
+}
+
+// List the data of a windowed ack at p: the high half of the offset
+// acked for a wide file, then what is held past it. Returns its length.
+static size_t sack_list(xfer* x, uint8_t* p) {
+    uint8_t* start = p;
+    uint32_t word;
+
+    if (x->wide) {
+        word = x->offset >> 32;
+        memcpy(p, &word, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+    }
+    for (unsigned i = 0; (i < x->range_count) && (i < NB_MAX_SACK); i++) {
+        if (x->wide) {
+            memcpy(p, x->ranges + i, sizeof(nbrange64));
+            p += sizeof(nbrange64);
+        } else {
+            nbrange r = { x->ranges[i].start, x->ranges[i].end };
+            memcpy(p, &r, sizeof(nbrange));
+            p += sizeof(nbrange);
+        }
+    }
+    return p - start;
+}
+
+// List what NB_STATS reports at p, and return its length
+static size_t stats_list(char* p) {
+    char* start = p;
+
+    // (bounded by the size of the names and counters, well within
+    // NB_MAX_STATS)
+    p += sprintf(p, "checksum") + 1;
+    p += sprintf(p, "%u", udp6_bad_checksums) + 1;
+    p += sprintf(p, "nobuf") + 1;
+    p += sprintf(p, "%u", netifc_buffer_misses) + 1;
+    for (int i = 0; i < NB_MAX_FILES; i++) {
+        xfer* x = xfers + i;
+        if (x->item == 0) {
+            continue;
+        }
+        p += sprintf(p, "file") + 1;
+        p += sprintf(p, "%s", x->name) + 1;
+        p += sprintf(p, "packets") + 1;
+        p += sprintf(p, "%u", x->packets) + 1;
+        p += sprintf(p, "bytes") + 1;
+        p += sprintf(p, "%llu", (unsigned long long)x->bytes) + 1;
+        p += sprintf(p, "dups") + 1;
+        p += sprintf(p, "%u", x->dups) + 1;
+        p += sprintf(p, "dropped") + 1;
+        p += sprintf(p, "%u", x->dropped) + 1;
+        p += sprintf(p, "recovered") + 1;
+        p += sprintf(p, "%u", x->recovered) + 1;
+    }
+    return p - start;
+}
 
 void udp6_recv(void* data, size_t len,
                const ip6_addr* daddr, uint16_t dport,
                const ip6_addr* saddr, uint16_t sport) {
     nbmsg* msg = data;
-    nbmsg ack;
+    uint8_t ackbuf[sizeof(nbmsg) + NB_MAX_STATS];
+    nbmsg* ack = (void*)ackbuf;
+    size_t acklen = sizeof(nbmsg);
+    const char* opts;
+    const char* crc;
+    const char* off;
+    nbfile* item;
+    uint8_t* payload;
+    uint64_t pos;
+    uint32_t word;
+    uint32_t err;
+    size_t size;
+    size_t n;
+    xfer* x;
 
+    if ((dport == TFTP_PORT) || (dport == TFTP_DATA_PORT)) {
+        if (udp6_check())
+            return;
+        tftp_recv(data, len, daddr, dport, saddr, sport);
+        nb_active = 1;
+        return;
+    }
     if (dport != NB_SERVER_PORT)
         return;
 
@@ -34,21 +720,58 @@ void udp6_recv(void* data, size_t len,
         return;
     len -= sizeof(nbmsg);
 
+    // data is checked as it is copied in (see item_write()), the rest now
+    if ((msg->cmd != NB_DATA) && udp6_check())
+        return;
+
+    // a host looking for bootloaders is answered at once, unless it
+    // would draw one into a transfer already under way
+    if (msg->cmd == NB_SOLICIT) {
+        if ((msg->magic == NB_MAGIC) && !nb_active) {
+            advertise(saddr, sport);
+        }
+        return;
+    }
+
+    // only windowed data (and its parity) is ever pushed to a group,
+    // and only the leader acks it
+    if (daddr->x[0] == 0xFF) {
+        if (((msg->cmd != NB_DATA) && (msg->cmd != NB_PARITY)) ||
+            ((x = xfer_find(msg->cookie)) == 0))
+            return;
+        if (!x->leader) {
+            if (msg->cmd == NB_DATA) {
+                item_write(x, msg->arg, msg->data, len);
+            } else if (x->fec) {
+                parity_recv(x, msg->arg, msg->data, len);
+            }
+            nb_active = 1;
+            return;
+        }
+    }
+
     //printf("netboot: MSG %08x %08x %08x %08x datalen %d\n",
     //	msg->magic, msg->cookie, msg->cmd, msg->arg, len);
 
-    if ((last_cookie == msg->cookie) &&
-        (last_cmd == msg->cmd) && (last_arg = msg->arg)) {
+    // (NB_CHUNKS, NB_STATS, NB_QUERY and NB_PARITY acks carry data, so
+    // they are always worked out anew, as are those for windowed data,
+    // whose ranges held may have changed since)
+    if ((last_cookie == msg->cookie) && (msg->cmd != NB_CHUNKS) && (msg->cmd != NB_STATS) &&
+        (msg->cmd != NB_QUERY) && (msg->cmd != NB_PARITY) &&
+        ((msg->cmd != NB_DATA) || (xfer_find(msg->cookie) == 0)) &&
+        (last_cmd == msg->cmd) && (last_arg == msg->arg)) {
+        if (udp6_check())
+            return;
         // host must have missed the ack. resend
-        ack.magic = NB_MAGIC;
-        ack.cookie = last_cookie;
-        ack.cmd = last_ack_cmd;
-        ack.arg = last_ack_arg;
+        ack->magic = NB_MAGIC;
+        ack->cookie = last_cookie;
+        ack->cmd = last_ack_cmd;
+        ack->arg = last_ack_arg;
         goto transmit;
     }
 
-    ack.cmd = NB_ACK;
-    ack.arg = 0;
+    ack->cmd = NB_ACK;
+    ack->arg = 0;
 
     switch (msg->cmd) {
     case NB_COMMAND:
@@ -59,76 +782,364 @@ void udp6_recv(void* data, size_t len,
     case NB_SEND_FILE:
         if (len == 0)
             return;
+        // the name may be followed by "key\0value\0" options
         msg->data[len - 1] = 0;
-        for (int i = 0; i < (len - 1); i++) {
+        opts = (char*)msg->data + strlen((char*)msg->data) + 1;
+        for (int i = 0; msg->data[i] != 0; i++) {
             if ((msg->data[i] < ' ') || (msg->data[i] > 127)) {
                 msg->data[i] = '.';
             }
         }
-        item = netboot_get_buffer((const char*) msg->data);
-        if (item) {
-            item->offset = 0;
+        // a host that says how large the file is gets a buffer to fit,
+        // and staging room for it if it may be compressed
+        size = (off = kv_get(opts, (char*)msg->data + len, "size")) ? atoll(off) : 0;
+        item = 0;
+        if (size && (msg->arg & NB_FILE_LZ4)) {
+            item = netboot_get_buffer((const char*) msg->data, size + RING_SPAN);
+        }
+        if ((item == 0) || (item->size < size)) {
+            item = netboot_get_buffer((const char*) msg->data, size);
+        }
+        if (item && (item->size < size)) {
+            printf("netboot: File '%s' is too large (%zu bytes)\n", (char*)msg->data, size);
+            ack->cmd = NB_ERROR_TOO_LARGE;
+        } else if (item) {
+            x = xfer_slot(item);
+            // a resent NB_SEND_FILE must not throw away data already acked
+            if ((x->item != item) || (x->cookie != msg->cookie)) {
+                if (x->item != item) {
+                    xfer_evict(x);
+                }
+                corrupt_forget(item);
+                // nor does a resumed one, up to where it resumes
+                off = 0;
+                if ((msg->arg & NB_FILE_RESUME) && (x->item == item) && !x->delta) {
+                    off = kv_get(opts, (char*)msg->data + len, "offset");
+                }
+                x->resumed = off && (atoll(off) <= item->offset);
+                item->offset = x->resumed ? atoll(off) : 0;
+                if (!x->resumed || (x->crcpos > item->offset)) {
+                    x->crc = 0;
+                    x->crcpos = 0;
+                }
+                x->item = item;
+                x->cookie = msg->cookie;
+                x->window = msg->arg & NB_WINDOW_MASK;
+                if (x->window > NB_MAX_WINDOW) {
+                    x->window = NB_MAX_WINDOW;
+                }
+                // hosts send a window of one block in lockstep
+                if (x->window < 2) {
+                    x->window = 0;
+                }
+                x->leader = !!(msg->arg & NB_FILE_LEADER);
+                x->age = ++xfer_age;
+                x->offset = item->offset;
+                x->range_count = 0;
+                x->ring = 0;
+                x->cpos = 0;
+                x->error = 0;
+                x->delta = 0;
+                x->wide = !!(msg->arg & NB_FILE_WIDE);
+                x->size = size;
+                x->fec = 0;
+                x->check = 0;
+                x->packets = 0;
+                x->bytes = 0;
+                x->dups = 0;
+                x->dropped = 0;
+                x->recovered = 0;
+                if ((n = strlen((char*)msg->data)) >= sizeof(x->name)) {
+                    n = sizeof(x->name) - 1;
+                }
+                memcpy(x->name, msg->data, n);
+                x->name[n] = 0;
+                if ((crc = kv_get(opts, (char*)msg->data + len, "crc32c")) != 0) {
+                    x->want = atoll(crc);
+                    x->check = 1;
+                }
+                // a file is sent as a delta when there is a copy to take
+                // chunks from, else compressed if it can be staged: the
+                // staging ring has to fit in the buffer, and bounds how
+                // much data may be in flight
+                if (x->resumed || x->wide) {
+                    if (x->resumed) {
+                        printf("netboot: Resume File '%s' at %zu...\n",
+                               (char*)msg->data, item->offset);
+                    }
+                } else if ((msg->arg & NB_FILE_DELTA) && x->window && item->index) {
+                    x->delta = 1;
+                } else if ((msg->arg & NB_FILE_LZ4) && x->window &&
+                    (item->size >= (RING_SPAN + (size ? size : LZ4_CHUNK)))) {
+                    x->ring = item->data + item->size - RING_SPAN;
+                    if (x->window > ((RING_SIZE - LZ4_HDR_LEN - LZ4_CHUNK) / blocksize())) {
+                        x->window = (RING_SIZE - LZ4_HDR_LEN - LZ4_CHUNK) / blocksize();
+                    }
+                }
+                // lost blocks can be rebuilt where they are stored as
+                // is, in place
+                if ((msg->arg & NB_FILE_FEC) && x->window && x->size && !x->delta &&
+                    !x->ring && (off = kv_get(opts, (char*)msg->data + len, "fec"))) {
+                    x->fec = atoll(off);
+                    if ((x->fec < 2) || (x->fec > NB_MAX_FEC)) {
+                        x->fec = 0;
+                    }
+                }
+            }
+            if (x->window == 0) {
+                lockstep = x;
+            } else if (lockstep == x) {
+                lockstep = 0;
+            }
+            ack->arg = x->window | (msg->arg & NB_FILE_LEADER) | (x->ring ? NB_FILE_LZ4 : 0) |
+                       (x->delta ? NB_FILE_DELTA : 0) | (x->resumed ? NB_FILE_RESUME : 0) |
+                       (x->wide ? NB_FILE_WIDE : 0) | (x->fec ? NB_FILE_FEC : 0);
             printf("netboot: Receive File '%s'...\n", (char*) msg->data);
         } else {
             printf("netboot: Rejected File '%s'...\n", (char*) msg->data);
-            ack.cmd = NB_ERROR_BAD_FILE;
+            ack->cmd = NB_ERROR_BAD_FILE;
         }
         break;
     case NB_DATA:
-        if (item == 0)
+        if ((x = xfer_find(msg->cookie)) != 0) {
+            if ((err = item_write(x, msg->arg, msg->data, len)) == ITEM_DROP)
+                return;
+            if (err) {
+                ack->cmd = err;
+            }
+            // cumulative, plus whatever is held past the first hole
+            ack->arg = x->offset;
+            acklen += sack_list(x, ackbuf + acklen);
+            break;
+        }
+        if (lockstep == 0)
             return;
-        if (msg->arg != item->offset)
+        item = lockstep->item;
+        payload = msg->data;
+        pos = msg->arg;
+        if (lockstep->wide) {
+            if (len < sizeof(uint32_t))
+                return;
+            memcpy(&word, payload, sizeof(uint32_t));
+            pos |= (uint64_t)word << 32;
+            payload += sizeof(uint32_t);
+            len -= sizeof(uint32_t);
+        }
+        // the next block goes past what is held, so it can be checked
+        // as it is copied in
+        if ((pos == item->offset) && (len <= (item->size - item->offset))) {
+            if (udp6_check_copy(item->data + item->offset, payload, len))
+                return;
+        } else if (udp6_check()) {
+            return;
+        }
+        lockstep->packets++;
+        lockstep->bytes += len + (payload - msg->data);
+        if (pos != item->offset) {
+            lockstep->dups++;
             return;
-        ack.arg = msg->arg;
+        }
+        ack->arg = msg->arg;
         if ((item->offset + len) > item->size) {
-            ack.cmd = NB_ERROR_TOO_LARGE;
+            ack->cmd = NB_ERROR_TOO_LARGE;
         } else {
-            memcpy(item->data + item->offset, msg->data, len);
             item->offset += len;
-            ack.cmd = NB_ACK;
+            xfer_digest(lockstep);
+            ack->cmd = NB_ACK;
         }
         break;
+    case NB_PARITY:
+        if (((x = xfer_find(msg->cookie)) == 0) || !x->fec)
+            return;
+        err = parity_recv(x, msg->arg, msg->data, len);
+        if (err) {
+            ack->cmd = err;
+        }
+        ack->arg = x->offset;
+        acklen += sack_list(x, ackbuf + acklen);
+        break;
+    case NB_CHUNKS:
+        if (((x = xfer_find(msg->cookie)) == 0) || !x->delta ||
+            ((len / sizeof(nbchunk)) > NB_MAX_CHUNKS)) {
+            ack->cmd = NB_ERROR_BAD_PARAM;
+            break;
+        }
+        ack->arg = msg->arg;
+        err = chunks_recv(x, (void*)msg->data, len / sizeof(nbchunk), ack->data);
+        if (err) {
+            ack->cmd = err;
+        } else {
+            acklen += NB_MAX_CHUNKS / 8;
+        }
+        break;
+    case NB_JOIN_GROUP:
+        if ((len < IP6_ADDR_LEN) || ip6_join_group((void*)msg->data)) {
+            ack->cmd = NB_ERROR_BAD_PARAM;
+        }
+        break;
+    case NB_STATS:
+        acklen += stats_list((char*)ack->data);
+        break;
+    case NB_QUERY:
+        if (len == 0)
+            return;
+        msg->data[len - 1] = 0;
+        // the decoded start of a compressed file is as good as any, but
+        // a delta's data is not in order
+        x = xfer_named((const char*) msg->data);
+        if (x && !x->delta) {
+            item = x->item;
+            ack->arg = item->offset;
+            if (x->crcpos != item->offset) {
+                x->crc = crc32c(0, item->data, item->offset);
+                x->crcpos = item->offset;
+            }
+        }
+        // (ack.arg only holds the low half of a wide file's offset)
+        acklen += sprintf((char*)ack->data, "crc32c") + 1;
+        acklen += sprintf((char*)ackbuf + acklen, "%u", (x && !x->delta) ? x->crc : 0) + 1;
+        acklen += sprintf((char*)ackbuf + acklen, "offset") + 1;
+        acklen += sprintf((char*)ackbuf + acklen, "%zu", (x && !x->delta) ? x->item->offset : 0) + 1;
+        break;
     case NB_BOOT:
+        if (xfers_verify()) {
+            printf("netboot: Refusing to boot\n");
+            ack->cmd = NB_ERROR_BAD_CRC;
+            break;
+        }
         nb_boot_now = 1;
         printf("netboot: Boot Kernel...\n");
         break;
     default:
-        ack.cmd = NB_ERROR_BAD_CMD;
-        ack.arg = 0;
+        ack->cmd = NB_ERROR_BAD_CMD;
+        ack->arg = 0;
     }
 
     last_cookie = msg->cookie;
     last_cmd = msg->cmd;
     last_arg = msg->arg;
-    last_ack_cmd = ack.cmd;
-    last_ack_arg = ack.arg;
+    last_ack_cmd = ack->cmd;
+    last_ack_arg = ack->arg;
 
-    ack.cookie = msg->cookie;
-    ack.magic = NB_MAGIC;
+    ack->cookie = msg->cookie;
+    ack->magic = NB_MAGIC;
 transmit:
     nb_active = 1;
-    udp6_send(&ack, sizeof(ack), saddr, sport, NB_SERVER_PORT);
+    udp6_send(ack, acklen, saddr, sport, NB_SERVER_PORT);
 }
 
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
 static char advertise_data[] =
     "version\00.1\0"
-    "serialno\0unknown\0"
-    "board\0unknown\0";
+    "window\0" STR(NB_MAX_WINDOW) "\0"
+    "files\0" STR(NB_MAX_FILES) "\0"
+    "compress\0lz4\0"
+    "verify\0crc32c\0"
+    "stats\0" "1\0"
+    "resume\0" "1\0"
+    "size\0" "1\0"
+    "offsets\0" "64\0"
+    "fec\0xor\0";
+
+// who the machine is, as netboot_identify() was told
+static char nb_serialno[64] = "unknown";
+static char nb_board[64] = "unknown";
+static char nb_uuid[40];
+
+static void identity_set(char* out, size_t max, const char* val) {
+    size_t len;
+
+    if ((val == NULL) || (val[0] == 0)) {
+        return;
+    }
+    len = strlen(val);
+    if (len >= max) {
+        len = max - 1;
+    }
+    memcpy(out, val, len);
+    out[len] = 0;
+}
 
-static void advertise(void) {
-    uint8_t buffer[256];
+void netboot_identify(const char* serialno, const char* board, const char* uuid) {
+    identity_set(nb_serialno, sizeof(nb_serialno), serialno);
+    identity_set(nb_board, sizeof(nb_board), board);
+    identity_set(nb_uuid, sizeof(nb_uuid), uuid);
+}
+
+// largest NB_DATA payload that fits in one frame, kept 8 byte aligned
+static size_t blocksize(void) {
+    return (UDP6_MAX_PAYLOAD - sizeof(nbmsg)) & ~7;
+}
+
+// Advertise to daddr: all nodes, to port NB_ADVERT_PORT, for a beacon,
+// or a host that solicited one
+static void advertise(const ip6_addr* daddr, uint16_t dport) {
+    uint8_t buffer[768];
     nbmsg* msg = (void*)buffer;
+    char* p = (char*)msg->data;
     msg->magic = NB_MAGIC;
     msg->cookie = 0;
     msg->cmd = NB_ADVERTISE;
     msg->arg = 0;
-    memcpy(msg->data, advertise_data, sizeof(advertise_data));
-    udp6_send(buffer, sizeof(nbmsg) + sizeof(advertise_data),
-              &ip6_ll_all_nodes, NB_ADVERT_PORT, NB_SERVER_PORT);
+    // skip the string literal's own terminator
+    memcpy(p, advertise_data, sizeof(advertise_data) - 1);
+    p += sizeof(advertise_data) - 1;
+    p += sprintf(p, "blocksize") + 1;
+    p += sprintf(p, "%zu", blocksize()) + 1;
+    p += sprintf(p, "serialno") + 1;
+    p += sprintf(p, "%s", nb_serialno) + 1;
+    p += sprintf(p, "board") + 1;
+    p += sprintf(p, "%s", nb_board) + 1;
+    if (nb_uuid[0]) {
+        p += sprintf(p, "uuid") + 1;
+        p += sprintf(p, "%s", nb_uuid) + 1;
+    }
+    const uint8_t* mac = ip6_mac_addr(0)->x;
+    p += sprintf(p, "mac") + 1;
+    p += sprintf(p, "%02x:%02x:%02x:%02x:%02x:%02x",
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]) + 1;
+    // (a beacon goes out of every interface, each the host can stripe over)
+    if (ip6_ifc_count > 1) {
+        p += sprintf(p, "nics") + 1;
+        for (unsigned n = 0; n < ip6_ifc_count; n++) {
+            if (n) {
+                *p++ = ',';
+            }
+            ip6toa(p, (void*)ip6_ll_addr(n));
+            p += strlen(p);
+        }
+        p++;
+    }
+    udp6_send(buffer, p - (char*)buffer, daddr, dport, NB_SERVER_PORT);
 }
 
-#define FAST_TICK 100
-#define SLOW_TICK 1000
+// Beacons start BEACON_MIN ms apart and back off to BEACON_MAX, each gap
+// twice the last, give or take a quarter so that machines powered on
+// together drift apart. Hosts that start later solicit instead of
+// waiting for the next one.
+#define BEACON_MIN 100
+#define BEACON_MAX 8000
+
+static uint32_t nb_interval;
+static uint32_t nb_jitter;
+
+static uint32_t jitter(uint32_t ms) {
+    uint32_t x = nb_jitter;
+
+    // xorshift32, seeded from the interface ID the MAC makes
+    if (x == 0) {
+        const uint8_t* id = ip6_ll_addr(0)->x + 8;
+        x = ((id[0] ^ id[4]) << 24) | ((id[1] ^ id[5]) << 16) |
+            ((id[2] ^ id[6]) << 8) | (id[3] ^ id[7]) | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    nb_jitter = x;
+    return ms - (ms / 4) + (x % ((ms / 2) + 1));
+}
 
 int netboot_init(void) {
     if (netifc_open()) {
@@ -138,7 +1149,6 @@ int netboot_init(void) {
     return 0;
 }
 
-static int nb_fastcount = 0;
 static int nb_online = 0;
 
 int netboot_poll(void) {
@@ -146,9 +1156,9 @@ int netboot_poll(void) {
         if (nb_online == 0) {
             printf("netboot: interface online\n");
             nb_online = 1;
-            nb_fastcount = 20;
-            netifc_set_timer(FAST_TICK);
-            advertise();
+            nb_interval = BEACON_MIN;
+            netifc_set_timer(jitter(nb_interval));
+            advertise(&ip6_ll_all_nodes, NB_ADVERT_PORT);
         }
     } else {
         if (nb_online == 1) {
@@ -158,18 +1168,19 @@ int netboot_poll(void) {
         return 0;
     }
     if (netifc_timer_expired()) {
-        if (nb_fastcount) {
-            nb_fastcount--;
-            netifc_set_timer(FAST_TICK);
-        } else {
-            netifc_set_timer(SLOW_TICK);
-        }
         if (nb_active) {
-            // don't advertise if we're in a transfer
+            // don't advertise if we're in a transfer, and start over
+            // from the shortest gap if it breaks off
             nb_active = 0;
+            nb_interval = BEACON_MIN;
         } else {
-            advertise();
+            advertise(&ip6_ll_all_nodes, NB_ADVERT_PORT);
+            nb_interval *= 2;
+            if (nb_interval > BEACON_MAX) {
+                nb_interval = BEACON_MAX;
+            }
         }
+        netifc_set_timer(jitter(nb_interval));
     }
 
     netifc_poll();
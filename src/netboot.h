@@ -10,12 +10,193 @@
 #define NB_ADVERT_PORT 33331
 
 #define NB_COMMAND 1   // arg=0, data=command
-#define NB_SEND_FILE 2 // arg=0, data=filename
-#define NB_DATA 3      // arg=blocknum, data=data
+#define NB_SEND_FILE 2 // arg=window, data=filename
+#define NB_DATA 3      // arg=offset, data=data
 #define NB_BOOT 4      // arg=0
+#define NB_JOIN_GROUP 5 // arg=0, data=ip6 multicast address
+#define NB_CHUNKS 6     // arg=first entry, data=nbchunk entries
+#define NB_STATS 7      // arg=0
+#define NB_QUERY 8      // arg=0, data=filename
+#define NB_SOLICIT 9    // arg=0
+#define NB_PARITY 10    // arg=offset, data=parity of a group of blocks
 
 #define NB_ACK 0
 
+// Discovery
+//
+// A bootloader beacons NB_ADVERTISE to ff02::1, port NB_ADVERT_PORT, as
+// soon as its link is up, then at gaps that double (with jitter) up to
+// a few seconds, but not while a transfer is under way.  A host need not
+// wait for the next one: NB_SOLICIT sent to ff02::1, port NB_SERVER_PORT,
+// has every bootloader that hears it and is not busy send NB_ADVERTISE
+// straight back to the address and port it came from.  It is not acked.
+
+// Windowed transfers
+//
+// A bootloader that supports windowed transfers advertises the largest
+// window it accepts (in blocks) under the "window" key.  The host asks
+// for a window in the NB_SEND_FILE arg and the bootloader acks with the
+// window it granted (0 means lockstep, which is all older peers speak).
+//
+// In windowed mode every NB_DATA packet of a file carries the cookie of
+// the NB_SEND_FILE that started it, the host may have up to window blocks
+// in flight, and each ack is cumulative: ack.arg is the number of bytes
+// received in order so far.  A repeated ack tells the host a block was lost.
+//
+// Blocks that arrive past a hole are stored at their offset anyway.  Acks
+// for a windowed transfer carry, after the header, up to NB_MAX_SACK
+// nbrange entries describing data held beyond ack.arg (lowest first), so
+// the host only needs to resend the holes between them.
+#define NB_WINDOW_MASK 0xFFFF
+#define NB_MAX_WINDOW 64
+#define NB_MAX_SACK 16
+
+// Multicast transfers
+//
+// To push one file to many targets the host has each of them join a group
+// (NB_JOIN_GROUP) and start a windowed transfer with the same cookie.
+// NB_DATA sent to the group is stored like unicast data, but only the
+// target whose NB_SEND_FILE set NB_FILE_LEADER acks it, which paces the
+// host.  Afterwards the host fills each target's holes over unicast.
+#define NB_FILE_LEADER 0x00010000
+
+// Concurrent transfers
+//
+// A bootloader that advertises the "files" key can receive that many
+// windowed files at once; their data is told apart by cookie.  This lets
+// the host start the next file while the last blocks of the previous one
+// are still in flight.  Only one lockstep transfer can be active at a time.
+#define NB_MAX_FILES 4
+
+// Compression
+//
+// A bootloader that advertises "compress" with the value "lz4" accepts a
+// file in the chunked LZ4 form described in lz4.h.  The host asks for it
+// per file by setting NB_FILE_LZ4 in the NB_SEND_FILE arg, and sends the
+// compressed form only if the ack has the flag set too.  Offsets in
+// NB_DATA and in acks then count bytes of the compressed form, which is
+// decompressed as it arrives.  Only windowed transfers are compressed.
+#define NB_FILE_LZ4 0x00020000
+
+// Delta transfers
+//
+// A bootloader that holds an earlier copy of a file (see netboot_cache)
+// can take the new one as a delta.  The host asks for it by setting
+// NB_FILE_DELTA in the NB_SEND_FILE arg, and the bootloader grants it by
+// setting the flag in its ack, in which case the file is not compressed.
+//
+// The host then sends the file's content defined chunks (see cdc.h) as
+// NB_CHUNKS messages of up to NB_MAX_CHUNKS nbchunk entries each.  The
+// bootloader copies every chunk it holds to its place in the file, and
+// acks each message with a bitmap of the entries it found (entry i of
+// the message is bit i % 8 of byte i / 8).  Once every NB_CHUNKS is
+// acked the host sends the chunks that were not found, in file order,
+// as one windowed stream: offsets in NB_DATA and acks count bytes of
+// that stream, and every NB_DATA payload starts with the 32 bit offset
+// in the file where the rest of it goes.
+#define NB_FILE_DELTA 0x00040000
+#define NB_MAX_CHUNKS 64
+
+// Integrity
+//
+// A bootloader that advertises "verify" with the value "crc32c" accepts
+// options after the name in NB_SEND_FILE, as "key\0value\0" pairs
+// following its terminator.  With "crc32c" set to the CRC-32C of the
+// file (in decimal), it checks the file as it arrives, and answers
+// NB_BOOT with NB_ERROR_BAD_CRC instead of booting if it does not match.
+
+// Resuming
+//
+// A bootloader that advertises "resume" answers NB_QUERY for a file with
+// how many bytes of it it holds in order from the start in ack.arg, and
+// "crc32c" set to the CRC-32C of those bytes in a "key\0value\0" list
+// after the header.  If they match its copy, the host may start the file
+// part way in by setting NB_FILE_RESUME in the NB_SEND_FILE arg, with the
+// "offset" option set to where (in decimal, at most what was held).  The
+// bootloader keeps what comes before it and sets the flag in its ack, or
+// starts from scratch without it.  A resumed file is sent as is.
+#define NB_FILE_RESUME 0x00080000
+
+// Sizes
+//
+// A bootloader that advertises "size" takes a "size" option in
+// NB_SEND_FILE, set to the length of the file in decimal.  It makes room
+// for that much before acking, and answers NB_ERROR_TOO_LARGE straight
+// away if it cannot.  Files sent without it get room for as much as the
+// bootloader is prepared to take.
+
+// Large files
+//
+// A bootloader that advertises "offsets" with the value "64" can take
+// files of 4GB and more.  The host asks for it per file by setting
+// NB_FILE_WIDE in the NB_SEND_FILE arg, and the bootloader grants it by
+// setting the flag in its ack, in which case the file is sent as is.
+// NB_DATA arg and ack arg then hold the low 32 bits of the offset, and
+// every NB_DATA payload starts with the high 32 bits of it, as does the
+// data of every windowed ack, followed by nbrange64 entries instead of
+// nbrange.  Offsets in options and NB_QUERY replies are
+// decimal, and a reply's "offset" key has the whole of the one in ack.arg.
+#define NB_FILE_WIDE 0x00100000
+
+// Block size
+//
+// The bootloader advertises the largest NB_DATA payload that fits in one
+// frame on its interface under the "blocksize" key.  Hosts may send any
+// size up to that.  Peers that do not advertise it get 1024 byte blocks.
+#define NB_DEFAULT_BLOCKSIZE 1024
+
+// Multiple interfaces
+//
+// A bootloader with more than one interface linked advertises on each of
+// them, from each one's own link local address, with the "nics" key set
+// to all of those addresses, comma separated, in the same order every
+// time.  The first is the one it is known by: everything but windowed
+// NB_DATA goes there.  Windowed NB_DATA may be sent to any of them, so
+// the host can stripe a file across the ports, NB_STRIPE blocks to one
+// port before moving on to the next.  Acks leave by the interface the
+// data came in on, and groups are only joined on the first interface.
+#define NB_MAX_NICS 4
+#define NB_STRIPE 8
+
+// Statistics
+//
+// A bootloader that advertises "stats" answers NB_STATS with what it
+// counted while receiving, as "key\0value\0" pairs in the ack: first
+// for the link ("checksum" for UDP packets dropped with a bad checksum,
+// "nobuf" for times the interface ran out of buffers), then for each
+// file, starting with its "file" name, the NB_DATA "packets" and
+// "bytes" received, "dups" that were already held and those "dropped"
+// for lack of room to hold them, and the blocks "recovered" from parity
+// (see below).  The host sends it once every file is in, before NB_BOOT.
+// The list is at most NB_MAX_STATS bytes long.
+#define NB_MAX_STATS 1024
+
+// Identity
+//
+// Advertisements carry the "serialno" and "board" of the machine ("unknown"
+// if it cannot tell), its "uuid" where it has one, and the "mac" address
+// of the first interface (as xx:xx:xx:xx:xx:xx), so that a host serving
+// several kinds of machine can pick which files to send each of them.
+
+// Forward error correction
+//
+// A bootloader that advertises "fec" with the value "xor" can rebuild a
+// lost block of a windowed file that is sent as is, if it was told the
+// size.  The host asks for it per file by setting NB_FILE_FEC in the
+// NB_SEND_FILE arg, with the "fec" option set to how many blocks make up
+// a group (at most NB_MAX_FEC), and the bootloader grants it by setting
+// the flag in its ack.  Groups are counted from the start of the file,
+// and the last one may be short.  Once the last block of a group has
+// gone out the host sends NB_PARITY, whose arg (and for a wide file,
+// leading word) gives the offset of the group's first block as NB_DATA
+// would, and whose payload is every block of the group XORed together,
+// each padded with zeros to a full block, which is how long the payload
+// is.  A bootloader missing one block of the group rebuilds it from the
+// others and stores it as if it had come in NB_DATA, and acks NB_PARITY
+// as it would have acked that.  Pushes to a group carry NB_PARITY too.
+#define NB_FILE_FEC 0x00200000
+#define NB_MAX_FEC 64
+
 #define NB_ADVERTISE 0x77777777
 
 #define NB_ERROR 0x80000000
@@ -23,6 +204,7 @@
 #define NB_ERROR_BAD_PARAM 0x80000002
 #define NB_ERROR_TOO_LARGE 0x80000003
 #define NB_ERROR_BAD_FILE 0x80000004
+#define NB_ERROR_BAD_CRC 0x80000005
 
 typedef struct nbmsg_t {
     uint32_t magic;
@@ -32,17 +214,64 @@ typedef struct nbmsg_t {
     uint8_t data[0];
 } nbmsg;
 
+typedef struct nbrange_t {
+    uint32_t start;
+    uint32_t end; // exclusive
+} nbrange;
+
+typedef struct nbrange64_t {
+    uint64_t start;
+    uint64_t end; // exclusive
+} nbrange64;
+
+typedef struct nbchunk_t {
+    uint64_t hash; // cdc_hash() of its contents
+    uint32_t offset;
+    uint32_t len;
+} nbchunk;
+
 typedef struct nbfile_t {
     uint8_t* data;
     size_t size; // max size of buffer
     size_t offset; // write pointer
+
+    // an earlier copy of the file, and its chunks hashed by content
+    const uint8_t* cache;
+    nbchunk* index;
+    size_t slots;
 } nbfile;
 
 int netboot_init(void);
 int netboot_poll(void);
 void netboot_close(void);
 
-// Ask for a buffer suitable to put the file /name/ in
+// Say who the machine is in advertisements (see Identity).  A NULL or
+// empty value leaves that key as it was.
+void netboot_identify(const char* serialno, const char* board, const char* uuid);
+
+// Make an earlier copy of a file, such as the one booted last, available
+// to delta transfers into item.  index must have room for
+// netboot_cache_slots(len) entries.  Both must stay put until boot.
+size_t netboot_cache_slots(size_t len);
+void netboot_cache(nbfile* item, const void* data, size_t len, nbchunk* index);
+
+// Whether the file last sent into item is all in, which is only known
+// if the host said how large it is.  Returns 0 if not, else a number
+// that is different each time the file is sent.
+uint32_t netboot_file_done(const nbfile* item);
+
+// A TFTP write (see tftp.h) into item takes its slot as NB_SEND_FILE
+// would, and ends any other transfer of it. netboot_tftp_start() returns
+// the id to pass to the others: netboot_tftp_held() says whether the
+// write still has the slot (an NB_SEND_FILE of the file takes it back),
+// and netboot_tftp_done() says the file is all in.
+uint32_t netboot_tftp_start(nbfile* item, const char* name);
+int netboot_tftp_held(const nbfile* item, uint32_t id);
+void netboot_tftp_done(const nbfile* item, uint32_t id);
+
+// Ask for a buffer suitable to put the file /name/ in, with room for
+// size bytes, or for as large as the file may be if size is 0.  A buffer
+// that cannot be made large enough may be returned as it is.
 // Return NULL to indicate /name/ is not wanted.
-nbfile* netboot_get_buffer(const char* name);
+nbfile* netboot_get_buffer(const char* name, size_t size);
 
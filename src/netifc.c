@@ -11,14 +11,8 @@
 #include <inet6.h>
 #include <netifc.h>
 
-static efi_simple_network_protocol* snp;
-
 #define MAX_FILTER 8
-static efi_mac_addr mcast_filters[MAX_FILTER];
-static unsigned mcast_filter_count = 0;
-
-#define NUM_BUFFER_PAGES 8
-#define ETH_BUFFER_SIZE 1516
+#define NUM_BUFFERS 32
 #define ETH_HEADER_SIZE 16
 #define ETH_BUFFER_MAGIC 0x424201020304A7A7UL
 
@@ -26,39 +20,68 @@ typedef struct eth_buffer_t eth_buffer;
 struct eth_buffer_t {
     uint64_t magic;
     eth_buffer* next;
+    uint64_t ifc; // the interface whose pool it is in
     uint8_t data[0];
 };
 
-static efi_physical_addr eth_buffers_base = 0;
-static eth_buffer* eth_buffers = NULL;
-
-void* eth_get_buffer(size_t sz) {
+// Every interface with a link is used, each with its own receive
+// filters and pool of buffers, so that one cannot starve another
+typedef struct {
+    efi_simple_network_protocol* snp;
+    efi_mac_addr mcast_filters[MAX_FILTER];
+    unsigned mcast_filter_count;
+    int filters_live; // set once netifc_open() has programmed them
+    eth_buffer* buffers;
+    size_t buffer_size;
+} nic;
+
+static nic nics[IP6_MAX_IFC];
+static unsigned nic_count = 0;
+
+// Buffers are power of two sized and aligned, so that eth_put_buffer()
+// can find the header from any pointer into the buffer. The slot fits
+// the largest MTU of any interface and is set up by netifc_open().
+static size_t eth_buffer_slot = 2048;
+
+// frames that could not be sent for want of a buffer (one to receive
+// into is only taken once the last has been handed back, and until then
+// frames wait in the interface)
+uint32_t netifc_buffer_misses = 0;
+
+static void* nic_get_buffer(nic* n, size_t sz) {
     eth_buffer* buf;
-    if (sz > ETH_BUFFER_SIZE) {
-        return NULL;
-    }
-    if (eth_buffers == NULL) {
+    if ((sz > n->buffer_size) || (n->buffers == NULL)) {
         return NULL;
     }
-    buf = eth_buffers;
-    eth_buffers = buf->next;
+    buf = n->buffers;
+    n->buffers = buf->next;
     buf->next = NULL;
     return buf->data;
 }
 
+void* eth_get_buffer(unsigned ifc, size_t sz) {
+    nic* n = nics + ifc;
+    void* data;
+    if (((data = nic_get_buffer(n, sz)) == NULL) && (sz <= n->buffer_size)) {
+        netifc_buffer_misses++;
+    }
+    return data;
+}
+
 void eth_put_buffer(void* data) {
-    eth_buffer* buf = (void*)(((uint64_t)data) & (~2047));
+    eth_buffer* buf = (void*)(((uint64_t)data) & (~(eth_buffer_slot - 1)));
 
     if (buf->magic != ETH_BUFFER_MAGIC) {
         printf("fatal: eth buffer %p (from %p) bad magic %lx\n", buf, data, buf->magic);
         for (;;)
             ;
     }
-    buf->next = eth_buffers;
-    eth_buffers = buf;
+    buf->next = nics[buf->ifc].buffers;
+    nics[buf->ifc].buffers = buf;
 }
 
-int eth_send(void* data, size_t len) {
+int eth_send(unsigned ifc, void* data, size_t len) {
+    efi_simple_network_protocol* snp = nics[ifc].snp;
     efi_status r;
 
     if ((r = snp->Transmit(snp, 0, len, (void*)data, NULL, NULL, NULL))) {
@@ -69,7 +92,7 @@ int eth_send(void* data, size_t len) {
     }
 }
 
-void eth_dump_status(void) {
+void eth_dump_status(efi_simple_network_protocol* snp) {
     printf("State/HwAdSz/HdrSz/MaxSz %d %d %d %d\n",
            snp->Mode->State, snp->Mode->HwAddressSize,
            snp->Mode->MediaHeaderSize, snp->Mode->MaxPacketSize);
@@ -84,13 +107,71 @@ void eth_dump_status(void) {
            snp->Mode->MediaPresentSupported, snp->Mode->MediaPresent);
 }
 
-int eth_add_mcast_filter(const mac_addr* addr) {
-    if (mcast_filter_count >= MAX_FILTER)
+static int eth_install_filters(nic* n) {
+    efi_simple_network_protocol* snp = n->snp;
+    efi_mac_addr* mcast_filters = n->mcast_filters;
+    unsigned mcast_filter_count = n->mcast_filter_count;
+    efi_status ret;
+    int j;
+
+    ret = snp->ReceiveFilters(snp,
+                            EFI_SIMPLE_NETWORK_RECEIVE_UNICAST |
+                                EFI_SIMPLE_NETWORK_RECEIVE_MULTICAST,
+                            0, 0, mcast_filter_count, (void*)mcast_filters);
+    if (ret) {
+        printf("Failed to install multicast filters %s\n", efi_strerror(ret));
         return -1;
-    if (mcast_filter_count >= snp->Mode->MaxMCastFilterCount)
+    }
+
+    if (snp->Mode->MCastFilterCount != mcast_filter_count) {
+        printf("OOPS: expected %d filters, found %d\n",
+               mcast_filter_count, snp->Mode->MCastFilterCount);
+        goto force_promisc;
+    }
+    for (size_t i = 0; i < mcast_filter_count; i++) {
+        //uint8_t *m = (void*) &mcast_filters[i];
+        //printf("i=%d %02x %02x %02x %02x %02x %02x\n", i, m[0], m[1], m[2], m[3], m[4], m[5]);
+        for (j = 0; j < mcast_filter_count; j++) {
+            //m = (void*) &snp->Mode->MCastFilter[j];
+            //printf("j=%d %02x %02x %02x %02x %02x %02x\n", j, m[0], m[1], m[2], m[3], m[4], m[5]);
+            if (!memcmp(mcast_filters + i, &snp->Mode->MCastFilter[j], 6)) {
+                goto found_it;
+            }
+        }
+        printf("OOPS: filter #%zu missing\n", i);
+        goto force_promisc;
+    found_it:;
+    }
+
+    return 0;
+
+force_promisc:
+    ret = snp->ReceiveFilters(snp,
+                            EFI_SIMPLE_NETWORK_RECEIVE_UNICAST |
+                                EFI_SIMPLE_NETWORK_RECEIVE_PROMISCUOUS |
+                                EFI_SIMPLE_NETWORK_RECEIVE_PROMISCUOUS_MULTICAST,
+                            0, 0, 0, NULL);
+    if (ret) {
+        printf("Failed to set promiscuous mode (%s)\n", efi_strerror(ret));
         return -1;
-    memcpy(mcast_filters + mcast_filter_count, addr, ETH_ADDR_LEN);
-    mcast_filter_count++;
+    }
+    return 0;
+}
+
+int eth_add_mcast_filter(unsigned ifc, const mac_addr* addr) {
+    nic* n = nics + ifc;
+
+    if (n->mcast_filter_count >= MAX_FILTER)
+        return -1;
+    if (n->mcast_filter_count >= n->snp->Mode->MaxMCastFilterCount)
+        return -1;
+    memcpy(n->mcast_filters + n->mcast_filter_count, addr, ETH_ADDR_LEN);
+    n->mcast_filter_count++;
+    // groups joined after netifc_open() need the filters reprogrammed
+    if (n->filters_live && eth_install_filters(n)) {
+        n->mcast_filter_count--;
+        return -1;
+    }
     return 0;
 }
 
@@ -116,14 +197,17 @@ int netifc_timer_expired(void) {
 }
 
 /* Search the available network interfaces via SimpleNetworkProtocol handles
- * and find the first valid one with a Link detected */
-efi_simple_network_protocol* netifc_find_available(void) {
+ * and find up to max valid ones with a Link detected, returning how many
+ * (and the handle each was opened from) */
+size_t netifc_find_available(efi_simple_network_protocol** found, efi_handle* found_handles,
+                             size_t max) {
     efi_boot_services* bs = gSys->BootServices;
     efi_status ret;
     efi_simple_network_protocol* cur_snp = NULL;
     efi_handle handles[32];
     char16_t *paths[32];
     size_t nic_cnt = 0;
+    size_t count = 0;
     size_t sz = sizeof(handles);
     uint32_t last_parent = 0;
     uint32_t int_sts;
@@ -133,7 +217,7 @@ efi_simple_network_protocol* netifc_find_available(void) {
     ret = bs->LocateHandle(ByProtocol, &SimpleNetworkProtocol, NULL, &sz, handles);
     if (ret != EFI_SUCCESS) {
         printf("Failed to locate network interfaces (%s)\n", efi_strerror(ret));
-        return NULL;
+        return 0;
     }
 
     nic_cnt = sz / sizeof(efi_handle);
@@ -141,8 +225,8 @@ efi_simple_network_protocol* netifc_find_available(void) {
         paths[i] = HandleToString(handles[i]);
     }
 
-    /* Iterate over our SNP list until we find one with an established link */
-    for (size_t i = 0; i < nic_cnt; i++) {
+    /* Iterate over our SNP list, taking those with an established link */
+    for (size_t i = 0; (i < nic_cnt) && (count < max); i++) {
          /* Check each interface once, but ignore any additional device paths a given interface
           * may provide. e1000 tends to add a path for ipv4 and ipv6 configuration information
           * for instance */
@@ -193,85 +277,101 @@ efi_simple_network_protocol* netifc_find_available(void) {
         }
 
         printf("Link detected!\n");
-        return cur_snp;
+        found_handles[count] = handles[i];
+        found[count++] = cur_snp;
+        continue;
 
 link_fail:
         bs->CloseProtocol(handles[i], &SimpleNetworkProtocol, gImg, NULL);
         cur_snp = NULL;
     }
 
-    return NULL;
+    return count;
+}
+
+// Give back an interface that netifc_find_available() brought up, but
+// that could not be used after all
+static void netifc_release(efi_handle h, efi_simple_network_protocol* snp) {
+    snp->Shutdown(snp);
+    snp->Stop(snp);
+    gBS->CloseProtocol(h, &SimpleNetworkProtocol, gImg, NULL);
 }
 
 int netifc_open(void) {
     efi_boot_services* bs = gSys->BootServices;
-    efi_status ret;
-    int j;
+    efi_simple_network_protocol* found[IP6_MAX_IFC];
+    efi_handle handles[IP6_MAX_IFC];
+    efi_physical_addr base;
+    size_t count;
+    size_t i;
+    int ret;
 
     bs->CreateEvent(EVT_TIMER, TPL_CALLBACK, NULL, NULL, &net_timer);
 
-    snp = netifc_find_available();
-    if (!snp) {
+    count = netifc_find_available(found, handles, IP6_MAX_IFC);
+    if (count == 0) {
         printf("Failed to find a usable network interface\n");
         return -1;
     }
 
-    if (bs->AllocatePages(AllocateAnyPages, EfiLoaderData, NUM_BUFFER_PAGES, &eth_buffers_base)) {
-        printf("Failed to allocate net buffers\n");
-        return -1;
-    }
-
-    uint8_t* ptr = (void*)eth_buffers_base;
-    for (ret = 0; ret < (NUM_BUFFER_PAGES * 2); ret++) {
-        eth_buffer* buf = (void*)ptr;
-        buf->magic = ETH_BUFFER_MAGIC;
-        eth_put_buffer(buf);
-        ptr += 2048;
+    // room for the 2 byte alignment pad in front of transmitted frames
+    for (i = 0; i < count; i++) {
+        efi_simple_network_protocol* snp = found[i];
+        size_t size = snp->Mode->MaxPacketSize + snp->Mode->MediaHeaderSize + 2;
+        while (eth_buffer_slot < (sizeof(eth_buffer) + size)) {
+            eth_buffer_slot *= 2;
+        }
     }
 
-    ip6_init(snp->Mode->CurrentAddress.addr);
-
-    ret = snp->ReceiveFilters(snp,
-                            EFI_SIMPLE_NETWORK_RECEIVE_UNICAST |
-                                EFI_SIMPLE_NETWORK_RECEIVE_MULTICAST,
-                            0, 0, mcast_filter_count, (void*)mcast_filters);
-    if (ret) {
-        printf("Failed to install multicast filters %s\n", efi_strerror(ret));
-        return -1;
-    }
+    // an interface that cannot be set up is skipped, as long as another can
+    for (i = 0; i < count; i++) {
+        efi_simple_network_protocol* snp = found[i];
+        nic* n = nics + nic_count;
+
+        memset(n, 0, sizeof(*n));
+        n->snp = snp;
+        // over-allocate so the pool can be aligned to the slot size
+        size_t pages = ((NUM_BUFFERS + 1) * eth_buffer_slot + 4095) / 4096;
+        if (bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &base)) {
+            printf("Failed to allocate net buffers\n");
+            goto skip;
+        }
 
-    eth_dump_status();
+        // MaxPacketSize does not include the media header
+        if (ip6_init(snp->Mode->CurrentAddress.addr,
+                     snp->Mode->MaxPacketSize + snp->Mode->MediaHeaderSize) < 0) {
+            goto skip_pages;
+        }
+        n->buffer_size = snp->Mode->MaxPacketSize + snp->Mode->MediaHeaderSize + 2;
 
-    if (snp->Mode->MCastFilterCount != mcast_filter_count) {
-        printf("OOPS: expected %d filters, found %d\n",
-               mcast_filter_count, snp->Mode->MCastFilterCount);
-        goto force_promisc;
-    }
-    for (size_t i = 0; i < mcast_filter_count; i++) {
-        //uint8_t *m = (void*) &mcast_filters[i];
-        //printf("i=%d %02x %02x %02x %02x %02x %02x\n", i, m[0], m[1], m[2], m[3], m[4], m[5]);
-        for (j = 0; j < mcast_filter_count; j++) {
-            //m = (void*) &snp->Mode->MCastFilter[j];
-            //printf("j=%d %02x %02x %02x %02x %02x %02x\n", j, m[0], m[1], m[2], m[3], m[4], m[5]);
-            if (!memcmp(mcast_filters + i, &snp->Mode->MCastFilter[j], 6)) {
-                goto found_it;
-            }
+        if (eth_install_filters(n)) {
+            ip6_drop();
+            goto skip_pages;
         }
-        printf("OOPS: filter #%zu missing\n", i);
-        goto force_promisc;
-    found_it:;
-    }
+        n->filters_live = 1;
+
+        // the pool is only handed over once the interface is in use
+        uint8_t* ptr = (void*)((base + eth_buffer_slot - 1) & (~(eth_buffer_slot - 1)));
+        for (ret = 0; ret < NUM_BUFFERS; ret++) {
+            eth_buffer* buf = (void*)ptr;
+            buf->magic = ETH_BUFFER_MAGIC;
+            buf->ifc = nic_count;
+            eth_put_buffer(buf);
+            ptr += eth_buffer_slot;
+        }
+        nic_count++;
 
-    return 0;
+        eth_dump_status(snp);
+        continue;
 
-force_promisc:
-    ret = snp->ReceiveFilters(snp,
-                            EFI_SIMPLE_NETWORK_RECEIVE_UNICAST |
-                                EFI_SIMPLE_NETWORK_RECEIVE_PROMISCUOUS |
-                                EFI_SIMPLE_NETWORK_RECEIVE_PROMISCUOUS_MULTICAST,
-                            0, 0, 0, NULL);
-    if (ret) {
-        printf("Failed to set promiscuous mode (%s)\n", efi_strerror(ret));
+skip_pages:
+        bs->FreePages(base, pages);
+skip:
+        memset(n, 0, sizeof(*n));
+        netifc_release(handles[i], snp);
+    }
+    if (nic_count == 0) {
+        printf("Failed to set up a network interface\n");
         return -1;
     }
     return 0;
@@ -280,16 +380,19 @@ force_promisc:
 void netifc_close(void) {
     gBS->SetTimer(net_timer, TimerCancel, 0);
     gBS->CloseEvent(net_timer);
-    snp->Shutdown(snp);
-    snp->Stop(snp);
+    for (unsigned i = 0; i < nic_count; i++) {
+        nics[i].snp->Shutdown(nics[i].snp);
+        nics[i].snp->Stop(nics[i].snp);
+    }
 }
 
 int netifc_active(void) {
-    return (snp != 0);
+    return (nic_count != 0);
 }
 
-void netifc_poll(void) {
-    uint8_t data[1514];
+static void nic_poll(unsigned ifc) {
+    efi_simple_network_protocol* snp = nics[ifc].snp;
+    uint8_t* data;
     efi_status r;
     size_t hsz, bsz;
     uint32_t irq;
@@ -303,17 +406,29 @@ void netifc_poll(void) {
         eth_put_buffer(txdone);
     }
 
+    // receive into a pool buffer, which is sized for the interface MTU
+    bsz = nics[ifc].buffer_size - 2;
+    if ((data = nic_get_buffer(nics + ifc, bsz)) == NULL) {
+        return;
+    }
     hsz = 0;
-    bsz = sizeof(data);
     r = snp->Receive(snp, &hsz, &bsz, data, NULL, NULL, NULL);
     if (r != EFI_SUCCESS) {
+        eth_put_buffer(data);
         return;
     }
 #if TRACE
-    printf("RX %02x:%02x:%02x:%02x:%02x:%02x < %02x:%02x:%02x:%02x:%02x:%02x %02x%02x %d\n",
+    printf("RX%u %02x:%02x:%02x:%02x:%02x:%02x < %02x:%02x:%02x:%02x:%02x:%02x %02x%02x %d\n", ifc,
             data[0], data[1], data[2], data[3], data[4], data[5],
             data[6], data[7], data[8], data[9], data[10], data[11],
             data[12], data[13], (int)(bsz - hsz));
 #endif
-    eth_recv(data, bsz);
+    eth_recv(ifc, data, bsz);
+    eth_put_buffer(data);
+}
+
+void netifc_poll(void) {
+    for (unsigned i = 0; i < nic_count; i++) {
+        nic_poll(i);
+    }
 }
@@ -4,6 +4,11 @@
 
 #pragma once
 
+#include <stdint.h>
+
+// frames that could not be sent, as eth_get_buffer() found no buffer free
+extern uint32_t netifc_buffer_misses;
+
 // setup networking
 int netifc_open(void);
 
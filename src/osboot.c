@@ -15,26 +15,59 @@
 #include <cmdline.h>
 #include <magenta.h>
 #include <netboot.h>
+#include <smbios.h>
 #include <utils.h>
 
 #define DEFAULT_TIMEOUT 3
 
+// how much room to make for files from hosts that do not say how large
+// they are
 #define KBUFSIZE (32*1024*1024)
 #define RBUFSIZE (256*1024*1024)
 
+// where the last netbooted ramdisk is kept, so that the next netboot
+// only needs the parts of it that changed
+#define RCACHE L"netboot.ramdisk"
+
 static char cmdextra[256];
 
 static nbfile nbkernel;
 static nbfile nbramdisk;
 static nbfile nbcmdline;
 
-nbfile* netboot_get_buffer(const char* name) {
+// Make room for size bytes in item, keeping what it holds so far. The
+// memory may be anywhere below max, or anywhere at all if max is 0. If
+// there is not enough, item is left as it is.
+static void nbfile_grow(nbfile* item, size_t size, efi_physical_addr max) {
+    efi_physical_addr mem = max;
+    size_t pages = (size + 4095) / 4096;
+
+    if (size <= item->size) {
+        return;
+    }
+    if (gBS->AllocatePages(max ? AllocateMaxAddress : AllocateAnyPages,
+                           EfiLoaderData, pages, &mem)) {
+        printf("Cannot allocate %zu bytes for netboot\n", size);
+        return;
+    }
+    if (item->data) {
+        memcpy((void*)mem, item->data, item->offset);
+        gBS->FreePages((efi_physical_addr)item->data, item->size / 4096);
+    }
+    item->data = (void*)mem;
+    item->size = pages * 4096;
+}
+
+nbfile* netboot_get_buffer(const char* name, size_t size) {
     // we know these are in a buffer large enough
     // that this is safe (todo: implement strcmp)
     if (!memcmp(name, "kernel.bin", 11)) {
+        nbfile_grow(&nbkernel, size ? size : KBUFSIZE, 0);
         return &nbkernel;
     }
     if (!memcmp(name, "ramdisk.bin", 11)) {
+        // the kernel is told where the ramdisk is in 32 bits
+        nbfile_grow(&nbramdisk, size ? size : RBUFSIZE, 0xFFFFFFFF);
         return &nbramdisk;
     }
     if (!memcmp(name, "cmdline", 7)) {
@@ -45,6 +78,43 @@ nbfile* netboot_get_buffer(const char* name) {
 
 static char cmdline[4096];
 
+static void* rcache;
+static size_t rcache_size;
+
+// Offer the ramdisk netbooted last to delta transfers
+static void load_rcache(void) {
+    efi_physical_addr mem;
+    size_t pages;
+
+    if ((rcache = LoadFile(RCACHE, &rcache_size)) == NULL) {
+        return;
+    }
+    pages = (netboot_cache_slots(rcache_size) * sizeof(nbchunk) + 4095) / 4096;
+    if (gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &mem)) {
+        printf("Failed to allocate ramdisk cache index\n");
+        return;
+    }
+    netboot_cache(&nbramdisk, rcache, rcache_size, (void*)mem);
+    printf("Cached ramdisk is %zu bytes\n", rcache_size);
+}
+
+// Keep the ramdisk for next time, unless it is what was kept already
+static void save_rcache(void) {
+    efi_status r;
+
+    if (nbramdisk.offset == 0) {
+        return;
+    }
+    if (rcache && (rcache_size == nbramdisk.offset) &&
+        !memcmp(rcache, nbramdisk.data, rcache_size)) {
+        return;
+    }
+    printf("Saving ramdisk for the next netboot...\n");
+    if ((r = SaveFile(RCACHE, nbramdisk.data, nbramdisk.offset)) != EFI_SUCCESS) {
+        printf("Cannot save ramdisk (%s)\n", efi_strerror(r));
+    }
+}
+
 enum {
     BOOT_DEVICE_NONE,
     BOOT_DEVICE_NETBOOT,
@@ -183,24 +253,38 @@ void draw_logo(efi_graphics_output_protocol* gop) {
     gop->Blt(gop, &fuchsia, EfiBltVideoFill, 0, 0, 0, v_res - (v_res/100), h_res, v_res/100, 0);
 }
 
-void do_netboot(efi_handle img, efi_system_table* sys) {
-    efi_boot_services* bs = sys->BootServices;
+// The kernel put in place ahead of NB_BOOT, and the transfer of
+// kernel.bin it was loaded from (see netboot_file_done)
+static kernel_t nbloaded;
+static uint32_t nbloaded_from;
 
-    efi_physical_addr mem = 0xFFFFFFFF;
-    if (bs->AllocatePages(AllocateMaxAddress, EfiLoaderData, KBUFSIZE / 4096, &mem)) {
-        printf("Failed to allocate network io buffer\n");
+static int is_efi_binary(const uint8_t* x) {
+    return (x[0] == 'M') && (x[1] == 'Z') && (x[0x80] == 'P') && (x[0x81] == 'E');
+}
+
+// Once kernel.bin is in, load it while the ramdisk is still arriving,
+// so that NB_BOOT only has to start it. A kernel sent again replaces it.
+static void preload_kernel(efi_boot_services* bs) {
+    uint32_t from = netboot_file_done(&nbkernel);
+
+    if ((from == 0) || (from == nbloaded_from)) {
         return;
     }
-    nbkernel.data = (void*) mem;
-    nbkernel.size = KBUFSIZE;
-
-    mem = 0xFFFFFFFF;
-    if (bs->AllocatePages(AllocateMaxAddress, EfiLoaderData, RBUFSIZE / 4096, &mem)) {
-        printf("Failed to allocate network io buffer\n");
+    unload_kernel(bs, &nbloaded);
+    nbloaded_from = from;
+    if ((nbkernel.offset < 32768) || is_efi_binary(nbkernel.data)) {
         return;
     }
-    nbramdisk.data = (void*) mem;
-    nbramdisk.size = RBUFSIZE;
+    printf("Loading kernel while the rest arrives...\n");
+    load_kernel(bs, nbkernel.data, nbkernel.offset, &nbloaded);
+}
+
+void do_netboot(efi_handle img, efi_system_table* sys) {
+    efi_boot_services* bs = sys->BootServices;
+
+    // the kernel and ramdisk buffers are allocated as they are sent,
+    // once it is known how large they need to be
+    load_rcache();
 
     nbcmdline.data = (void*) cmdline;
     nbcmdline.size = sizeof(cmdline) - 1;
@@ -212,14 +296,14 @@ void do_netboot(efi_handle img, efi_system_table* sys) {
     for (;;) {
         int n = netboot_poll();
         if (n < 1) {
+            preload_kernel(bs);
             continue;
         }
         if (nbkernel.offset < 32768) {
             // too small to be a kernel
             continue;
         }
-        uint8_t* x = nbkernel.data;
-        if ((x[0] == 'M') && (x[1] == 'Z') && (x[0x80] == 'P') && (x[0x81] == 'E')) {
+        if (is_efi_binary(nbkernel.data)) {
             size_t exitdatasize;
             efi_status r;
             efi_handle h;
@@ -261,6 +345,11 @@ void do_netboot(efi_handle img, efi_system_table* sys) {
             continue;
         }
 
+        // the kernel loaded early is only good if it is the one sent last
+        if (nbloaded.image && (netboot_file_done(&nbkernel) != nbloaded_from)) {
+            unload_kernel(bs, &nbloaded);
+        }
+
         // make sure network traffic is not in flight, etc
         netboot_close();
 
@@ -270,14 +359,22 @@ void do_netboot(efi_handle img, efi_system_table* sys) {
         // ensure cmdline is null terminated
         cmdline[nbcmdline.offset] = 0;
 
+        save_rcache();
+
         // maybe it's a kernel image?
         efi_graphics_output_protocol* gop;
         bs->LocateProtocol(&GraphicsOutputProtocol, NULL, (void**)&gop);
         set_graphics_mode(sys, gop, cmdline);
 
-        boot_kernel(img, sys, (void*) nbkernel.data, nbkernel.offset,
-                    (void*) nbramdisk.data, nbramdisk.offset,
-                    cmdline, strlen(cmdline), cmdextra, strlen(cmdextra));
+        if (nbloaded.image) {
+            start_loaded_kernel(img, sys, &nbloaded,
+                                (void*) nbramdisk.data, nbramdisk.offset,
+                                cmdline, strlen(cmdline), cmdextra, strlen(cmdextra));
+        } else {
+            boot_kernel(img, sys, (void*) nbkernel.data, nbkernel.offset,
+                        (void*) nbramdisk.data, nbramdisk.offset,
+                        cmdline, strlen(cmdline), cmdextra, strlen(cmdextra));
+        }
         break;
     }
 }
@@ -313,6 +410,14 @@ EFIAPI efi_status efi_main(efi_handle img, efi_system_table* sys) {
     // See if there's a network interface
     bool have_network = netboot_init() == 0;
 
+    // and tell hosts which machine this is, so each can be sent its own
+    smbios_id id;
+    if (have_network && (smbios_identify(sys, &id) == 0)) {
+        printf("System: %s, serial number %s\n\n",
+               id.board[0] ? id.board : "unknown", id.serialno[0] ? id.serialno : "unknown");
+        netboot_identify(id.serialno, id.board, id.uuid);
+    }
+
     // Look for a kernel image on disk
     // TODO: use the filesystem protocol
     size_t ksz = 0;
@@ -340,10 +445,18 @@ EFIAPI efi_status efi_main(efi_handle img, efi_system_table* sys) {
             do_netboot(img, sys);
             break;
         case BOOT_DEVICE_LOCAL: {
+            // as with netboot, the kernel is put in place before the
+            // ramdisk is read, leaving only the handover for after
+            kernel_t k;
+            printf("boot_kernel() from %p (%ld bytes)\n", kernel, ksz);
+            if (load_kernel(bs, kernel, ksz, &k)) {
+                printf("Failed to load kernel image\n");
+                break;
+            }
             size_t rsz = 0;
             void* ramdisk = LoadFile(L"ramdisk.bin", &rsz);
-            boot_kernel(img, sys, kernel, ksz, ramdisk, rsz,
-                        cmdline, csz, cmdextra, strlen(cmdextra));
+            start_loaded_kernel(img, sys, &k, ramdisk, rsz,
+                                cmdline, csz, cmdextra, strlen(cmdextra));
             break;
         }
         default:
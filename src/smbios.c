@@ -0,0 +1,149 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <smbios.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <utils.h>
+
+#define SMBIOS_TABLE_GUID \
+    {0xeb9d2d31, 0x2d88, 0x11d3, {0x9a, 0x16, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d}}
+#define SMBIOS3_TABLE_GUID \
+    {0xf2fd1544, 0x9794, 0x4a2c, {0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94}}
+
+static efi_guid SmbiosTableGUID = SMBIOS_TABLE_GUID;
+static efi_guid Smbios3TableGUID = SMBIOS3_TABLE_GUID;
+
+// structure types, and where in them the fields we want are
+#define TYPE_SYSTEM 1
+#define TYPE_BASEBOARD 2
+#define TYPE_END 127
+
+#define SYSTEM_PRODUCT 0x05
+#define SYSTEM_SERIAL 0x07
+#define SYSTEM_UUID 0x08
+#define BASEBOARD_PRODUCT 0x05
+#define BASEBOARD_SERIAL 0x07
+
+// Copy string number n of the structure at s (counting from 1), which
+// follow its formatted part, trimmed of spaces
+static void smbios_string(const uint8_t* s, const uint8_t* end, uint8_t n,
+                          char* out, size_t max) {
+    const char* p = (const char*)s + s[1];
+    size_t len;
+
+    out[0] = 0;
+    if (n == 0) {
+        return;
+    }
+    while ((const uint8_t*)p < end) {
+        len = strlen(p);
+        if (--n == 0) {
+            break;
+        }
+        if (len == 0) {
+            return;
+        }
+        p += len + 1;
+    }
+    if ((n != 0) || ((const uint8_t*)p >= end)) {
+        return;
+    }
+    while (*p == ' ') {
+        p++;
+        len--;
+    }
+    while ((len > 0) && (p[len - 1] == ' ')) {
+        len--;
+    }
+    if (len >= max) {
+        len = max - 1;
+    }
+    memcpy(out, p, len);
+    out[len] = 0;
+}
+
+// The UUID is kept with its first three fields little endian
+static void smbios_uuid(const uint8_t* u, char* out) {
+    int blank = 1;
+
+    for (int i = 0; i < 16; i++) {
+        if ((u[i] != 0x00) && (u[i] != 0xFF)) {
+            blank = 0;
+        }
+    }
+    if (blank) {
+        out[0] = 0;
+        return;
+    }
+    sprintf(out, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+            u[3], u[2], u[1], u[0], u[5], u[4], u[7], u[6],
+            u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+int smbios_identify(efi_system_table* sys, smbios_id* id) {
+    efi_configuration_table* cfgtab = sys->ConfigurationTable;
+    const uint8_t* table = NULL;
+    const uint8_t* end;
+    char board[sizeof(id->board)];
+    char serialno[sizeof(id->serialno)];
+    size_t size = 0;
+
+    memset(id, 0, sizeof(*id));
+    for (size_t i = 0; i < sys->NumberOfTableEntries; i++) {
+        const uint8_t* ep = cfgtab[i].VendorTable;
+        // the 64 bit entry point is preferred, where there is one
+        if (!CompareGuid(&cfgtab[i].VendorGuid, &Smbios3TableGUID) &&
+            !memcmp(ep, "_SM3_", 5)) {
+            table = (const uint8_t*)*(const uint64_t*)(ep + 0x10);
+            size = *(const uint32_t*)(ep + 0x0C);
+            break;
+        }
+        if (!CompareGuid(&cfgtab[i].VendorGuid, &SmbiosTableGUID) &&
+            !memcmp(ep, "_SM_", 4)) {
+            table = (const uint8_t*)(uint64_t)*(const uint32_t*)(ep + 0x18);
+            size = *(const uint16_t*)(ep + 0x16);
+        }
+    }
+    if (table == NULL) {
+        return -1;
+    }
+
+    board[0] = 0;
+    serialno[0] = 0;
+    end = table + size;
+    for (const uint8_t* s = table; (s + 4) <= end; ) {
+        const uint8_t* next = s + s[1];
+        if (s[1] < 4) {
+            break;
+        }
+        // the strings end with an empty one
+        while (((next + 1) < end) && (next[0] || next[1])) {
+            next++;
+        }
+        next += 2;
+        if (s[0] == TYPE_END) {
+            break;
+        }
+        if ((s[0] == TYPE_SYSTEM) && (s[1] > SYSTEM_SERIAL)) {
+            smbios_string(s, end, s[SYSTEM_PRODUCT], id->board, sizeof(id->board));
+            smbios_string(s, end, s[SYSTEM_SERIAL], id->serialno, sizeof(id->serialno));
+            if (s[1] >= (SYSTEM_UUID + 16)) {
+                smbios_uuid(s + SYSTEM_UUID, id->uuid);
+            }
+        } else if ((s[0] == TYPE_BASEBOARD) && (s[1] > BASEBOARD_SERIAL)) {
+            smbios_string(s, end, s[BASEBOARD_PRODUCT], board, sizeof(board));
+            smbios_string(s, end, s[BASEBOARD_SERIAL], serialno, sizeof(serialno));
+        }
+        s = next;
+    }
+    if (id->board[0] == 0) {
+        memcpy(id->board, board, sizeof(board));
+    }
+    if (id->serialno[0] == 0) {
+        memcpy(id->serialno, serialno, sizeof(serialno));
+    }
+    return 0;
+}
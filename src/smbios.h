@@ -0,0 +1,20 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <efi/system-table.h>
+
+// What the firmware's SMBIOS tables say a machine is: the serial number
+// and product name of the system (or failing that, of its baseboard),
+// and the system UUID.  Each is "" where the tables do not say.
+typedef struct {
+    char serialno[64];
+    char board[64];
+    char uuid[37];
+} smbios_id;
+
+// Fill in id from the SMBIOS tables listed among the configuration
+// tables.  Returns -1 if there are none.
+int smbios_identify(efi_system_table* sys, smbios_id* id);
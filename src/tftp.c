@@ -0,0 +1,264 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <inet6.h>
+#include <netboot.h>
+#include <tftp.h>
+
+#define OP_RRQ 1
+#define OP_WRQ 2
+#define OP_DATA 3
+#define OP_ACK 4
+#define OP_ERROR 5
+#define OP_OACK 6
+
+#define ERR_UNDEFINED 0
+#define ERR_NOT_FOUND 1
+#define ERR_DISK_FULL 3
+#define ERR_ILLEGAL_OP 4
+#define ERR_UNKNOWN_TID 5
+#define ERR_BAD_OPTION 8
+
+#define DEFAULT_BLKSIZE 512
+
+// The transfer in progress, or the last one. Only one runs at a time; a
+// new write request takes over from it.
+static struct {
+    nbfile* item;
+    uint32_t id; // its slot in netboot (see netboot_tftp_start())
+    ip6_addr peer;
+    uint16_t port;
+    int active;
+    int done; // the last block is in
+    size_t blksize;
+    uint32_t window;
+    uint64_t count;  // blocks received in order
+    uint64_t acked;  // blocks last acked
+    uint32_t stray;  // blocks out of order since the last one in order
+} xfer;
+
+static void tftp_send(const void* data, size_t len, const ip6_addr* daddr, uint16_t dport) {
+    udp6_send(data, len, daddr, dport, TFTP_DATA_PORT);
+}
+
+static void tftp_error(uint16_t code, const char* msg,
+                       const ip6_addr* daddr, uint16_t dport) {
+    uint8_t buf[128];
+    size_t n = strlen(msg) + 1;
+
+    buf[0] = 0;
+    buf[1] = OP_ERROR;
+    buf[2] = code >> 8;
+    buf[3] = code;
+    memcpy(buf + 4, msg, n);
+    tftp_send(buf, 4 + n, daddr, dport);
+}
+
+static void tftp_ack(void) {
+    uint8_t buf[4] = { 0, OP_ACK, (uint8_t)(xfer.count >> 8), (uint8_t)xfer.count };
+
+    xfer.acked = xfer.count;
+    tftp_send(buf, sizeof(buf), &xfer.peer, xfer.port);
+}
+
+// Find the value of key in the options that follow a request, which end
+// in a terminator. Option names are not case sensitive.
+static const char* opt_get(const char* p, const char* end, const char* key) {
+    size_t n = strlen(key);
+
+    while (p < end) {
+        const char* val = p + strlen(p) + 1;
+        if (val >= end) {
+            break;
+        }
+        if (strlen(p) == n) {
+            size_t i;
+            for (i = 0; (i < n) && ((p[i] | 0x20) == key[i]); i++)
+                ;
+            if (i == n) {
+                return val;
+            }
+        }
+        p = val + strlen(val) + 1;
+    }
+    return 0;
+}
+
+static void tftp_wrq(char* msg, size_t len, const ip6_addr* saddr, uint16_t sport) {
+    char* end = msg + len;
+    char* name = msg + 2;
+    char* mode;
+    char* opts;
+    const char* val;
+    uint8_t oack[128];
+    char* p = (char*)oack + 2;
+    size_t tsize = 0;
+    size_t max = UDP6_MAX_PAYLOAD - 4;
+
+    // (the request must end in a terminator for the strings to end)
+    end[-1] = 0;
+    mode = name + strlen(name) + 1;
+    if (mode >= end) {
+        tftp_error(ERR_ILLEGAL_OP, "bad request", saddr, sport);
+        return;
+    }
+    opts = mode + strlen(mode) + 1;
+    for (size_t i = 0; mode[i]; i++) {
+        mode[i] |= 0x20;
+    }
+    if ((strlen(mode) != 5) || memcmp(mode, "octet", 5)) {
+        tftp_error(ERR_ILLEGAL_OP, "only octet mode is supported", saddr, sport);
+        return;
+    }
+    if ((val = opt_get(opts, end, "tsize")) != 0) {
+        tsize = atoll(val);
+    }
+    if ((xfer.item = netboot_get_buffer(name, tsize)) == 0) {
+        printf("netboot: Rejected File '%s' (tftp)...\n", name);
+        tftp_error(ERR_NOT_FOUND, "file not wanted", saddr, sport);
+        xfer.active = 0;
+        return;
+    }
+    if (xfer.item->size < tsize) {
+        printf("netboot: File '%s' is too large (%zu bytes)\n", name, tsize);
+        tftp_error(ERR_DISK_FULL, "file too large", saddr, sport);
+        xfer.active = 0;
+        return;
+    }
+    printf("netboot: Receive File '%s' (tftp)...\n", name);
+    xfer.id = netboot_tftp_start(xfer.item, name);
+    memcpy(&xfer.peer, saddr, sizeof(ip6_addr));
+    xfer.port = sport;
+    xfer.active = 1;
+    xfer.done = 0;
+    xfer.item->offset = 0;
+    xfer.blksize = DEFAULT_BLKSIZE;
+    xfer.window = 1;
+    xfer.count = 0;
+    xfer.acked = 0;
+    xfer.stray = 0;
+
+    // agree to the options we know, at values we can take
+    oack[0] = 0;
+    oack[1] = OP_OACK;
+    if ((val = opt_get(opts, end, "blksize")) != 0) {
+        xfer.blksize = atoll(val);
+        if (xfer.blksize < 8) {
+            tftp_error(ERR_BAD_OPTION, "bad blksize", saddr, sport);
+            xfer.active = 0;
+            return;
+        }
+        if (xfer.blksize > max) {
+            xfer.blksize = max;
+        }
+        p += sprintf(p, "blksize") + 1;
+        p += sprintf(p, "%zu", xfer.blksize) + 1;
+    }
+    if (opt_get(opts, end, "tsize")) {
+        p += sprintf(p, "tsize") + 1;
+        p += sprintf(p, "%zu", tsize) + 1;
+    }
+    if ((val = opt_get(opts, end, "windowsize")) != 0) {
+        xfer.window = atoll(val);
+        if (xfer.window < 1) {
+            tftp_error(ERR_BAD_OPTION, "bad windowsize", saddr, sport);
+            xfer.active = 0;
+            return;
+        }
+        if (xfer.window > TFTP_MAX_WINDOW) {
+            xfer.window = TFTP_MAX_WINDOW;
+        }
+        p += sprintf(p, "windowsize") + 1;
+        p += sprintf(p, "%u", xfer.window) + 1;
+    }
+    // without options, the write is acked as block 0
+    if (p == ((char*)oack + 2)) {
+        tftp_ack();
+    } else {
+        tftp_send(oack, (uint8_t*)p - oack, &xfer.peer, xfer.port);
+    }
+}
+
+static void tftp_data(uint8_t* msg, size_t len) {
+    nbfile* item = xfer.item;
+    uint16_t block = (msg[2] << 8) | msg[3];
+    size_t n = len - 4;
+    uint64_t off = xfer.count * xfer.blksize;
+
+    // only the block after the last one in order counts, and none do
+    // once the short one that ends the file is in
+    if (xfer.done || (block != (uint16_t)(xfer.count + 1)) || (n > xfer.blksize)) {
+        // ack where we are, once for each window the client sends
+        // over again
+        if ((xfer.stray++ % xfer.window) == 0) {
+            tftp_ack();
+        }
+        return;
+    }
+    if (!netboot_tftp_held(item, xfer.id)) {
+        printf("netboot: File taken over by netboot (tftp)\n");
+        tftp_error(ERR_UNDEFINED, "file taken over", &xfer.peer, xfer.port);
+        xfer.active = 0;
+        return;
+    }
+    if ((n > item->size) || (off > (item->size - n))) {
+        printf("netboot: File is too large (tftp)\n");
+        tftp_error(ERR_DISK_FULL, "file too large", &xfer.peer, xfer.port);
+        xfer.active = 0;
+        return;
+    }
+    memcpy(item->data + off, msg + 4, n);
+    item->offset = off + n;
+    xfer.count++;
+    xfer.stray = 0;
+    if (n < xfer.blksize) {
+        xfer.done = 1;
+        netboot_tftp_done(item, xfer.id);
+        printf("netboot: Received %zu bytes (tftp)\n", item->offset);
+        tftp_ack();
+    } else if ((xfer.count - xfer.acked) == xfer.window) {
+        tftp_ack();
+    }
+}
+
+void tftp_recv(void* data, size_t len,
+               const ip6_addr* daddr, uint16_t dport,
+               const ip6_addr* saddr, uint16_t sport) {
+    uint8_t* msg = data;
+    uint16_t op;
+
+    if (len < 4) {
+        return;
+    }
+    op = (msg[0] << 8) | msg[1];
+    if (dport == TFTP_PORT) {
+        if (op == OP_WRQ) {
+            tftp_wrq(data, len, saddr, sport);
+        } else {
+            tftp_error(ERR_ILLEGAL_OP, "only write requests are taken", saddr, sport);
+        }
+        return;
+    }
+    if (!xfer.active || (sport != xfer.port) ||
+        memcmp(saddr, &xfer.peer, sizeof(ip6_addr))) {
+        tftp_error(ERR_UNKNOWN_TID, "unknown transfer", saddr, sport);
+        return;
+    }
+    switch (op) {
+    case OP_DATA:
+        tftp_data(msg, len);
+        break;
+    case OP_ERROR:
+        printf("netboot: Transfer aborted (tftp)\n");
+        xfer.active = 0;
+        break;
+    default:
+        tftp_error(ERR_ILLEGAL_OP, "only data is taken", saddr, sport);
+    }
+}
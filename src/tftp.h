@@ -0,0 +1,25 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#pragma once
+
+#include <inet6.h>
+
+// TFTP write requests (RFC 1350) are taken on TFTP_PORT, and the
+// transfer they start runs from TFTP_DATA_PORT. Files go to the buffers
+// netboot_get_buffer() hands out, as if sent by nbserver, and booting
+// is still up to NB_BOOT.
+//
+// The blksize (RFC 2348), tsize (RFC 2349) and windowsize (RFC 7440)
+// options are taken, so that a client can send blocks as large as a
+// frame, a window of them at a time. Only octet mode is supported.
+#define TFTP_PORT 69
+#define TFTP_DATA_PORT 33332
+
+#define TFTP_MAX_WINDOW 64
+
+// Handle a UDP packet sent to either port
+void tftp_recv(void* data, size_t len,
+               const ip6_addr* daddr, uint16_t dport,
+               const ip6_addr* saddr, uint16_t sport);
@@ -0,0 +1,433 @@
+// Copyright 2016 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A virtual bootloader: the netboot stack osboot runs (inet6.c and
+// netboot.c), built for Linux on top of a user space Ethernet. Frames
+// go to a tap interface, which nbserver can reach like any other link,
+// or one per UDP datagram to a peer, the way qemu's "-netdev socket,udp="
+// frames them. Given more than one link, it has a NIC on each, as a
+// target with several ports does. It takes one netboot and reports how
+// it went.
+
+#include <arpa/inet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// (linux/if_ether.h has an ETH_MAX_MTU of its own)
+#undef ETH_MAX_MTU
+
+#include "inet6.h"
+#include "netboot.h"
+#include "netifc.h"
+
+// how much room to make for files from hosts that do not say how large
+// they are (as osboot does)
+#define KBUFSIZE (32*1024*1024)
+#define RBUFSIZE (256*1024*1024)
+
+static char* appname;
+
+// the tap interface or UDP socket frames go through, for each link
+static int fds[IP6_MAX_IFC];
+static unsigned fd_count = 0;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Transmit buffers come from a fixed pool for each link, like the ones
+// netifc.c hands out, so that running out of them is seen here too
+#define NUM_BUFFERS 32
+#define BUFFER_SIZE 16384
+
+static uint8_t eth_pool[IP6_MAX_IFC][NUM_BUFFERS][BUFFER_SIZE];
+static uint8_t* eth_free[IP6_MAX_IFC][NUM_BUFFERS];
+static unsigned eth_free_count[IP6_MAX_IFC];
+static size_t eth_buffer_size;
+
+uint32_t netifc_buffer_misses = 0;
+
+void* eth_get_buffer(unsigned ifc, size_t sz) {
+    if (sz > eth_buffer_size) {
+        return NULL;
+    }
+    if (eth_free_count[ifc] == 0) {
+        netifc_buffer_misses++;
+        return NULL;
+    }
+    return eth_free[ifc][--eth_free_count[ifc]];
+}
+
+void eth_put_buffer(void* data) {
+    size_t n = ((uint8_t*)data - eth_pool[0][0]) / BUFFER_SIZE;
+    unsigned ifc = n / NUM_BUFFERS;
+
+    if (ifc >= IP6_MAX_IFC) {
+        fprintf(stderr, "%s: fatal: eth buffer %p is not from the pool\n", appname, data);
+        abort();
+    }
+    eth_free[ifc][eth_free_count[ifc]++] = eth_pool[ifc][n % NUM_BUFFERS];
+}
+
+int eth_send(unsigned ifc, void* data, size_t len) {
+    int r = write(fds[ifc], data, len);
+
+    eth_put_buffer(data);
+    return (r < 0) ? -1 : 0;
+}
+
+// A tap passes every frame the host sends, so the filters a NIC would
+// apply are applied on receive
+#define MAX_FILTER 8
+static mac_addr mcast_filters[IP6_MAX_IFC][MAX_FILTER];
+static unsigned mcast_filter_count[IP6_MAX_IFC];
+
+int eth_add_mcast_filter(unsigned ifc, const mac_addr* addr) {
+    if (mcast_filter_count[ifc] == MAX_FILTER) {
+        return -1;
+    }
+    memcpy(mcast_filters[ifc] + mcast_filter_count[ifc], addr, ETH_ADDR_LEN);
+    mcast_filter_count[ifc]++;
+    return 0;
+}
+
+static int eth_filter(unsigned ifc, const uint8_t* dst) {
+    if (!(dst[0] & 1)) {
+        return 0;
+    }
+    for (unsigned i = 0; i < mcast_filter_count[ifc]; i++) {
+        if (!memcmp(mcast_filters[ifc] + i, dst, ETH_ADDR_LEN)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t timer_deadline = 0;
+
+void netifc_set_timer(uint32_t ms) {
+    timer_deadline = now() + (uint64_t)ms * 1000;
+}
+
+int netifc_timer_expired(void) {
+    return timer_deadline && (now() >= timer_deadline);
+}
+
+int netifc_open(void) {
+    for (unsigned n = 0; n < fd_count; n++) {
+        eth_free_count[n] = 0;
+        for (int i = 0; i < NUM_BUFFERS; i++) {
+            eth_free[n][eth_free_count[n]++] = eth_pool[n][i];
+        }
+    }
+    return (fd_count == 0) ? -1 : 0;
+}
+
+int netifc_active(void) {
+    return fd_count != 0;
+}
+
+void netifc_close(void) {
+}
+
+// Wait for frames on any link until the timer is due, then take in all
+// that are there
+void netifc_poll(void) {
+    static uint8_t frame[BUFFER_SIZE];
+    struct pollfd p[IP6_MAX_IFC];
+    uint64_t t = now();
+    int timeout = 0;
+    ssize_t r;
+
+    for (unsigned n = 0; n < fd_count; n++) {
+        p[n].fd = fds[n];
+        p[n].events = POLLIN;
+    }
+    if (timer_deadline > t) {
+        timeout = (timer_deadline - t + 999) / 1000;
+    }
+    if (poll(p, fd_count, timeout) <= 0) {
+        return;
+    }
+    for (unsigned n = 0; n < fd_count; n++) {
+        if (!(p[n].revents & POLLIN)) {
+            continue;
+        }
+        while ((r = read(fds[n], frame, sizeof(frame))) > 0) {
+            if ((r >= ETH_HDR_LEN) && !eth_filter(n, frame)) {
+                eth_recv(n, frame, r);
+            }
+        }
+    }
+}
+
+static nbfile nbkernel;
+static nbfile nbramdisk;
+static nbfile nbcmdline;
+
+// when the first file was asked for
+static uint64_t started;
+
+// Make room for size bytes in item, keeping what it holds so far
+static void nbfile_grow(nbfile* item, size_t size) {
+    uint8_t* data;
+
+    if (size <= item->size) {
+        return;
+    }
+    if ((data = realloc(item->data, size)) == NULL) {
+        fprintf(stderr, "%s: cannot allocate %zu bytes for netboot\n", appname, size);
+        return;
+    }
+    item->data = data;
+    item->size = size;
+}
+
+nbfile* netboot_get_buffer(const char* name, size_t size) {
+    if (started == 0) {
+        started = now();
+    }
+    if (!strcmp(name, "kernel.bin")) {
+        nbfile_grow(&nbkernel, size ? size : KBUFSIZE);
+        return &nbkernel;
+    }
+    if (!strcmp(name, "ramdisk.bin")) {
+        nbfile_grow(&nbramdisk, size ? size : RBUFSIZE);
+        return &nbramdisk;
+    }
+    if (!strcmp(name, "cmdline")) {
+        return &nbcmdline;
+    }
+    return NULL;
+}
+
+// Offer a copy of the ramdisk to delta transfers, as osboot does with
+// the one it netbooted last
+static int load_cache(const char* path) {
+    FILE* f;
+    uint8_t* data;
+    nbchunk* index;
+    long len;
+
+    if ((f = fopen(path, "rb")) == NULL) {
+        fprintf(stderr, "%s: cannot open '%s'\n", appname, path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(len ? len : 1);
+    index = malloc(netboot_cache_slots(len) * sizeof(nbchunk));
+    if ((data == NULL) || (index == NULL) || (fread(data, 1, len, f) != (size_t)len)) {
+        fprintf(stderr, "%s: cannot read '%s'\n", appname, path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    netboot_cache(&nbramdisk, data, len, index);
+    fprintf(stderr, "%s: cached ramdisk is %ld bytes\n", appname, len);
+    return 0;
+}
+
+static int save_file(const char* dir, const char* name, const nbfile* item) {
+    char path[4096];
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if ((f = fopen(path, "wb")) == NULL) {
+        fprintf(stderr, "%s: cannot create '%s'\n", appname, path);
+        return -1;
+    }
+    if (item->offset && (fwrite(item->data, item->offset, 1, f) != 1)) {
+        fprintf(stderr, "%s: cannot write '%s'\n", appname, path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+static int open_tap(const char* name) {
+    struct ifreq ifr;
+    int s;
+
+    if ((s = open("/dev/net/tun", O_RDWR)) < 0) {
+        fprintf(stderr, "%s: cannot open /dev/net/tun %d\n", appname, errno);
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(s, TUNSETIFF, &ifr) < 0) {
+        fprintf(stderr, "%s: cannot attach to tap '%s' %d\n", appname, name, errno);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// Frames go one per datagram between 127.0.0.1:local and :remote
+static int open_udp(const char* ports) {
+    struct sockaddr_in addr;
+    char* end;
+    int s, n = 4 * 1024 * 1024;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        fprintf(stderr, "%s: cannot create socket %d\n", appname, errno);
+        return -1;
+    }
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+    addr.sin_port = htons(strtoul(ports, &end, 10));
+    if ((*end != ':') || (bind(s, (void*)&addr, sizeof(addr)) < 0)) {
+        fprintf(stderr, "%s: cannot bind to '%s'\n", appname, ports);
+        close(s);
+        return -1;
+    }
+    addr.sin_port = htons(strtoul(end + 1, NULL, 10));
+    if (connect(s, (void*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "%s: cannot connect to '%s'\n", appname, ports);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+void usage(void) {
+    fprintf(stderr,
+            "usage:   %s [ <option> ]* ( -t <tap> | -u <port>:<peer port> )+\n"
+            "\n"
+            "options: -t  attach to this tap interface\n"
+            "         -u  send frames in UDP datagrams on 127.0.0.1, from port\n"
+            "             to peer port, like qemu's -netdev socket,udp=\n"
+            "         -a  MAC address to use (xx:xx:xx:xx:xx:xx), which\n"
+            "             each further link counts up from\n"
+            "         -M  MTU of the link, including the Ethernet header\n"
+            "         -c  offer this file to delta transfers as the last ramdisk\n"
+            "         -o  save the files received to this directory\n"
+            "         -S  serial number to advertise, as if from SMBIOS\n"
+            "         -B  board name to advertise, as if from SMBIOS\n"
+            "\n"
+            "Up to %d links may be given. It takes one netboot, then prints\n"
+            "a summary and exits.\n",
+            appname, IP6_MAX_IFC);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    uint8_t mac[ETH_ADDR_LEN] = { 0x02, 0x76, 0x62, 0, 0, 0 };
+    static char cmdline[4096];
+    const char* cache = NULL;
+    const char* dir = NULL;
+    size_t mtu = 1514;
+    uint64_t t;
+    uint64_t kt = 0;
+    size_t total;
+
+    appname = argv[0];
+    // keep the stack's messages in step with ours
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    // (a locally administered address, different for each instance)
+    mac[3] = getpid() >> 16;
+    mac[4] = getpid() >> 8;
+    mac[5] = getpid();
+    while (argc > 1) {
+        if (argc < 3)
+            usage();
+        if (!strcmp(argv[1], "-t") || !strcmp(argv[1], "-u")) {
+            if (fd_count == IP6_MAX_IFC)
+                usage();
+            fds[fd_count] = (argv[1][1] == 't') ? open_tap(argv[2]) : open_udp(argv[2]);
+            if (fds[fd_count] < 0)
+                usage();
+            // (netifc_poll() reads until there is nothing left)
+            fcntl(fds[fd_count], F_SETFL, fcntl(fds[fd_count], F_GETFL) | O_NONBLOCK);
+            fd_count++;
+        } else if (!strcmp(argv[1], "-a")) {
+            if (sscanf(argv[2], "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", mac, mac + 1, mac + 2,
+                       mac + 3, mac + 4, mac + 5) != 6)
+                usage();
+        } else if (!strcmp(argv[1], "-M")) {
+            mtu = strtoul(argv[2], NULL, 0);
+            if ((mtu < 1280) || (mtu > BUFFER_SIZE))
+                usage();
+        } else if (!strcmp(argv[1], "-c")) {
+            cache = argv[2];
+        } else if (!strcmp(argv[1], "-o")) {
+            dir = argv[2];
+        } else if (!strcmp(argv[1], "-S")) {
+            netboot_identify(argv[2], NULL, NULL);
+        } else if (!strcmp(argv[1], "-B")) {
+            netboot_identify(NULL, argv[2], NULL);
+        } else {
+            usage();
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (fd_count == 0) {
+        usage();
+    }
+    if (cache && load_cache(cache)) {
+        return 1;
+    }
+    eth_buffer_size = mtu + 2;
+
+    nbcmdline.data = (void*)cmdline;
+    nbcmdline.size = sizeof(cmdline) - 1;
+    nbcmdline.offset = 0;
+
+    for (unsigned n = 0; n < fd_count; n++) {
+        ip6_init(mac, mtu);
+        mac[5]++;
+    }
+    if (netboot_init()) {
+        return 1;
+    }
+    // (noting when the kernel is in, which is when osboot loads it)
+    while (netboot_poll() != 1) {
+        if ((kt == 0) && netboot_file_done(&nbkernel)) {
+            kt = now() - started;
+        }
+    }
+    t = now() - started;
+    netboot_close();
+
+    // ensure cmdline is null terminated
+    cmdline[nbcmdline.offset] = 0;
+    total = nbkernel.offset + nbramdisk.offset + nbcmdline.offset;
+    fprintf(stderr, "%s: kernel %zu bytes, ramdisk %zu bytes, cmdline '%s'\n", appname,
+            nbkernel.offset, nbramdisk.offset, cmdline);
+    fprintf(stderr, "%s: %zu bytes in %llu ms (%.1f MB/s), %u times out of buffers\n",
+            appname, total, (unsigned long long)t / 1000,
+            t ? (total / (double)t) : 0.0, netifc_buffer_misses);
+    if (kt) {
+        fprintf(stderr, "%s: kernel was in %llu ms before NB_BOOT\n", appname,
+                (unsigned long long)(t - kt) / 1000);
+    }
+    if (dir && (save_file(dir, "kernel.bin", &nbkernel) ||
+                save_file(dir, "ramdisk.bin", &nbramdisk) ||
+                save_file(dir, "cmdline", &nbcmdline))) {
+        return 1;
+    }
+    return 0;
+}